@@ -0,0 +1,107 @@
+#ifndef AGENT_RNG_H
+#define AGENT_RNG_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <random>
+
+// Stream families, so an agent and a stock with the same id draw from
+// unrelated streams
+const uint64_t RNG_AGENT_STREAM = 0;
+const uint64_t RNG_STOCK_STREAM = 1;
+
+inline uint64_t splitmix64(uint64_t& state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+namespace detail {
+    inline uint64_t& masterSeedSlot() {
+        thread_local uint64_t seed = [] {
+            std::random_device rd;
+            return (static_cast<uint64_t>(rd()) << 32) | rd();
+        }();
+        return seed;
+    }
+}
+
+// Seed every stream of the simulations built on this thread is derived from.
+// It starts from one std::random_device draw per thread; set it to make a run
+// reproducible.
+inline void setMasterSeed(uint64_t seed) {
+    detail::masterSeedSlot() = seed;
+}
+
+inline uint64_t getMasterSeed() {
+    return detail::masterSeedSlot();
+}
+
+// xoshiro256** generator: 32 bytes of state, usable with the standard
+// distributions. Streams are derived deterministically from the master seed,
+// a stream family and an index such as the agent id.
+class AgentRng {
+private:
+    uint64_t state[4];
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+public:
+    using result_type = uint64_t;
+
+    AgentRng() : AgentRng(0) {}
+
+    explicit AgentRng(uint64_t seed) {
+        uint64_t mix = seed;
+        for (auto & word : this->state) {
+            word = splitmix64(mix);
+        }
+    }
+
+    // The index-th stream of a family under the given master seed
+    static AgentRng stream(uint64_t masterSeed, uint64_t family, uint64_t index) {
+        uint64_t mix = masterSeed ^ (family * 0xd1b54a32d192ed03ULL);
+        uint64_t familySeed = splitmix64(mix);
+        mix = familySeed ^ index;
+        return AgentRng(splitmix64(mix));
+    }
+
+    static AgentRng forAgent(int id) {
+        return stream(getMasterSeed(), RNG_AGENT_STREAM, static_cast<uint64_t>(id));
+    }
+
+    // Child generator for a sub-stream of this one
+    AgentRng split(uint64_t index) const {
+        return stream(this->state[0] ^ this->state[3], this->state[1], index);
+    }
+
+    static constexpr result_type min() {
+        return 0;
+    }
+
+    static constexpr result_type max() {
+        return std::numeric_limits<result_type>::max();
+    }
+
+    result_type operator()() {
+        uint64_t result = rotl(this->state[1] * 5, 7) * 9;
+        uint64_t t = this->state[1] << 17;
+        this->state[2] ^= this->state[0];
+        this->state[3] ^= this->state[1];
+        this->state[1] ^= this->state[2];
+        this->state[0] ^= this->state[3];
+        this->state[2] ^= t;
+        this->state[3] = rotl(this->state[3], 45);
+        return result;
+    }
+
+    bool operator==(const AgentRng& other) const {
+        return std::equal(std::begin(this->state), std::end(this->state), std::begin(other.state));
+    }
+};
+#endif
@@ -0,0 +1,150 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "experiment.h"
+
+// Grid of the benchmark: every mode runs with every trader and thread count
+struct BenchSpec {
+    std::vector<EconMode> modes = {EconMode::DMA, EconMode::MPI};
+    std::vector<int> traderCounts = {1000, 10000, 100000};
+    std::vector<int> threadCounts = {1};
+    int rounds = 50;
+    // runs per configuration discarded before measuring
+    int warmup = 1;
+    int repetitions = 5;
+    uint64_t seed = 1;
+};
+
+struct BenchResult {
+    EconMode mode = EconMode::DMA;
+    int traders = 0;
+    int threads = 1;
+    int rounds = 0;
+    int repetitions = 0;
+    // over the rounds of all measured repetitions
+    int64_t medianRoundNs = 0;
+    int64_t p95RoundNs = 0;
+    double agentStepsPerSecond = 0;
+    long peakRssKb = 0;
+    // false when the peak could not be reset before the configuration, so
+    // peakRssKb is the high-water mark of the whole process
+    bool rssIsolated = false;
+};
+
+// Nearest-rank percentile, p in (0, 1]
+inline int64_t percentile(std::vector<int64_t> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(std::ceil(p * values.size()));
+    return values[std::min(values.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+// Reset the peak resident set size of the process to its current size;
+// false where Linux' clear_refs is not available
+inline bool resetPeakRss() {
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    if (!clearRefs) {
+        return false;
+    }
+    clearRefs << "5";
+    clearRefs.flush();
+    return static_cast<bool>(clearRefs);
+}
+
+// Peak resident set size in kB, from /proc when available
+inline long peakRssKb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::stol(line.substr(6));
+        }
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Measure one configuration; every repetition runs the same seed, so all of
+// them do the same work
+inline BenchResult runBenchConfig(const BenchSpec& spec, EconMode mode, int traders, int threads) {
+    ExperimentConfig config = {mode, traders, spec.rounds, spec.seed, 0, threads};
+    for (int i = 0; i < spec.warmup; i++) {
+        runExperiment(config);
+    }
+    BenchResult result;
+    result.mode = mode;
+    result.traders = traders;
+    result.threads = threads;
+    result.rounds = spec.rounds;
+    result.repetitions = spec.repetitions;
+    result.rssIsolated = resetPeakRss();
+
+    std::vector<int64_t> roundNs;
+    size_t agentSteps = 0;
+    int64_t totalNs = 0;
+    for (int i = 0; i < spec.repetitions; i++) {
+        ExperimentResult run = runExperiment(config);
+        for (const auto & round : run.stats.rounds) {
+            roundNs.push_back(round.totalNs);
+            totalNs += round.totalNs;
+        }
+        agentSteps += run.stats.agentsStepped();
+    }
+    result.peakRssKb = peakRssKb();
+    result.medianRoundNs = percentile(roundNs, 0.5);
+    result.p95RoundNs = percentile(roundNs, 0.95);
+    result.agentStepsPerSecond = totalNs > 0 ? agentSteps * 1e9 / totalNs : 0;
+    return result;
+}
+
+// Every configuration of the grid, one after the other so they do not
+// compete for cores
+inline std::vector<BenchResult> runBench(const BenchSpec& spec) {
+    std::vector<BenchResult> results;
+    for (const auto & mode : spec.modes) {
+        for (const auto & traders : spec.traderCounts) {
+            for (const auto & threads : spec.threadCounts) {
+                results.push_back(runBenchConfig(spec, mode, traders, threads));
+            }
+        }
+    }
+    return results;
+}
+
+inline void writeBenchCsv(std::ostream& out, const std::vector<BenchResult>& results) {
+    out << "mode,traders,threads,rounds,repetitions,median_round_ns,p95_round_ns,agent_steps_per_s,peak_rss_kb,rss_isolated\n";
+    for (const auto & result : results) {
+        out << modeName(result.mode) << ',' << result.traders << ',' << result.threads << ',' << result.rounds << ','
+            << result.repetitions << ',' << result.medianRoundNs << ',' << result.p95RoundNs << ','
+            << static_cast<int64_t>(result.agentStepsPerSecond) << ',' << result.peakRssKb << ','
+            << (result.rssIsolated ? 1 : 0) << '\n';
+    }
+}
+
+inline void writeBenchJson(std::ostream& out, const std::vector<BenchResult>& results) {
+    out << "[";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& result = results[i];
+        out << (i > 0 ? ",\n " : "") << "{\"mode\":\"" << modeName(result.mode) << "\",\"traders\":" << result.traders
+            << ",\"threads\":" << result.threads << ",\"rounds\":" << result.rounds
+            << ",\"repetitions\":" << result.repetitions << ",\"median_round_ns\":" << result.medianRoundNs
+            << ",\"p95_round_ns\":" << result.p95RoundNs
+            << ",\"agent_steps_per_s\":" << static_cast<int64_t>(result.agentStepsPerSecond)
+            << ",\"peak_rss_kb\":" << result.peakRssKb << ",\"rss_isolated\":" << (result.rssIsolated ? "true" : "false") << "}";
+    }
+    out << "]\n";
+}
+#endif
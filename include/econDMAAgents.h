@@ -3,8 +3,12 @@
 
 #include "simulation.h"
 #include "economics.h"
+#include "traderPopulation.h"
+#include "perfCounters.h"
 #include <vector>
 #include <random>
+#include <memory>
+#include <utility>
 
 class DMATrader;
 
@@ -13,136 +17,153 @@ private:
     int buyOrders = 0;
     int sellOrders = 0;
     double stockPrice = 100;
-    Stock* stock; 
+    std::unique_ptr<Stock> stock;
     double dividend = 0;
     std::vector<DMATrader*> traders = {};
+    // state of all traders in traders, informed in one pass per round
+    TraderPopulation population;
+    // informs and tallies slices of the population in parallel
+    int numThreads = 1;
+    std::unique_ptr<WorkerPool> pool = std::make_unique<WorkerPool>(1);
+    std::vector<std::pair<int, int>> workerOrders;
+    // fused rounds count the orders while informing, traders do not submit them
+    bool fused = false;
+    // hardware events of every step, and of each market worker in the current one
+    bool perfCounters = false;
+    std::vector<PerfSample> stepPerf;
+    std::vector<PerfSample> workerPerf;
+
+    // Add the per-worker order counts to the running totals in worker order,
+    // so the totals do not depend on the thread count
+    void addWorkerOrders() {
+        for (const auto & buy_sell : this->workerOrders) {
+            this->buyOrders += buy_sell.first;
+            this->sellOrders += buy_sell.second;
+        }
+    }
+
+    // Fold the orders traders submitted this round into the running totals.
+    // Each worker counts a contiguous slice.
+    void collectOrders() {
+        if (this->fused) {
+            return;
+        }
+        this->workerOrders.assign(this->numThreads, {0, 0});
+        this->pool->run([this](int worker) {
+            auto range = WorkerPool::partition(this->population.size(), worker, this->numThreads);
+            this->workerOrders[worker] = this->population.collectOrders(range.first, range.second);
+        });
+        this->addWorkerOrders();
+    }
 
 public:    
-    DMAMarket(int id) : Agent(id) {}
+    DMAMarket(int id) : Agent(id), stock(std::make_unique<Stock>(0.1, id)) {
+        this->phase = MARKET_PHASE;
+        this->atRoundEnd([this] { this->collectOrders(); });
+    }
+
+    void updateTraders(std::vector<DMATrader*> traders);
+
+    // Threads the market informs its traders and tallies their orders with,
+    // independent of the threads the simulation steps agents with
+    void setThreads(int threads) {
+        this->numThreads = std::max(1, threads);
+        if (this->pool->size() != this->numThreads) {
+            this->pool = std::make_unique<WorkerPool>(this->numThreads);
+        }
+    }
+
+    int getThreads() const {
+        return this->numThreads;
+    }
+
+    // In a fused round the market counts the orders its traders decide on
+    // while informing them, in the same pass over their state. The traders
+    // then submit nothing and need not be simulated at all. Prices and
+    // trader state are the same as when every trader steps each round.
+    void setFusedRound(bool fused) {
+        this->fused = fused;
+    }
+
+    bool isFusedRound() const {
+        return this->fused;
+    }
 
-    void updateTraders(std::vector<DMATrader*> traders) {
-        this->traders.insert(this->traders.begin(), traders.begin(), traders.end());
-        int totalTraders = (this->traders).size();
-        stock = new Stock(0.1 / totalTraders);
+    // Count hardware events of every step, summed over the market's threads;
+    // see PerfCounters
+    void setPerfCounters(bool enabled) {
+        this->perfCounters = enabled;
     }
 
-    void traderAction(int action) {
-        if (action == 1) {
-            buyOrders += 1;
-        } 
-        if (action == 2) {
-            sellOrders += 1;
+    // Events of each step since counting was enabled
+    const std::vector<PerfSample>& getStepPerf() const {
+        return this->stepPerf;
+    }
+
+    PerfSample getTotalStepPerf() const {
+        PerfSample total = PerfSample::zero();
+        for (const auto & sample : this->stepPerf) {
+            total += sample;
         }
+        return total;
+    }
+
+    // Record the order of the trader at the given population index. Every
+    // trader writes only its own slot, so traders may step concurrently; the
+    // orders are tallied at the end of the round.
+    void traderAction(size_t index, int action) {
+        this->population.orders[index] = action;
+    }
+
+    double getStockPrice() const {
+        return this->stockPrice;
+    }
+
+    int getBuyOrders() const {
+        return this->buyOrders;
+    }
+
+    int getSellOrders() const {
+        return this->sellOrders;
+    }
+
+    // The market's stock, e.g. to stream its price history or configure its
+    // indicators; it keeps these settings when traders are added
+    Stock& getStock() {
+        return *this->stock;
+    }
+
+    TraderPopulation& getPopulation() {
+        return this->population;
     }
 
     virtual int step();
 };
 
+// Handle to one trader of a DMAMarket's TraderPopulation. Its state lives in
+// the population once the market has taken it in updateTraders.
 class DMATrader: public Agent {
 private:
-    WealthManagement* wealth; 
-    DMAMarket* market;
-    int traderAction = 0;
-    int currentRule = 1;
-
-    // rule, strength
-    std::unordered_map<int, int> learnRule = {};
-    std::mt19937 gen; 
-    std::uniform_int_distribution<int> distribution;
-
-    int eval(int rule, double stockPrice, std::vector<int> marketState, double cash, double shares) {
-        int action = 0; 
-        switch (rule) {
-            case 1: 
-                if (marketState.at(0)==INCREASE && stockPrice < cash){
-                    action = 1;
-                } else if (marketState.at(0)==2 && shares >= 1) {
-                    action = 2;
-                } else {
-                    action = 0;
-                }
-                break;
-            case 2:
-                if (marketState.at(1) == INCREASE && shares >= 1){
-                    action = 2;
-                } else if (stockPrice < cash && marketState.at(2) == DECREASE){
-                    action = 1;
-                } else {
-                    action = 0;
-                }
-                break; 
-            case 3:
-                if (marketState.at(1) == INCREASE && stockPrice < cash){
-                    action = 1;
-                } else if (marketState.at(1) == INCREASE && shares >= 1){
-                    action = 2;
-                } else {
-                    action = 0;
-                }
-                break;
-            case 4:
-                if (distribution(gen) < 3){
-                    if (stockPrice < cash) {
-                        action = 1;
-                    } else {
-                        action = 0;
-                    }
-                } else {
-                    if (shares >= 1) {
-                        action = 2;
-                    } else {
-                        action = 0;
-                    }
-                }    
-                break;
-            case 5:
-                if (marketState.at(2) == INCREASE && shares >= 1){
-                    action = 2;
-                } else if (marketState.at(2) == DECREASE && stockPrice < cash){
-                    action = 1;
-                } else {
-                    action = 0;
-                }
-                break;
-            default:
-                break;
-        }
-        return action;
-    }
+    DMAMarket* market = nullptr;
+    TraderPopulation* population = nullptr;
+    size_t index = 0;
 
 public:
     DMATrader(int id) : Agent(id) {
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        this->gen = gen;
-        std::uniform_int_distribution<int> distribution(1, 5);
-        this->distribution = distribution;
-        this->wealth = new WealthManagement(1000, 0.001);
-    }
-
-    void inform(double stockPrice, double dividend, std::vector<int> market) {
-        this->wealth->addDividends(dividend);
-        double updatedWealth = this->wealth->estimateWealth(stockPrice);
-        // increase the strength if wealth has increased
-        if (updatedWealth > this->wealth->wealth) {
-            learnRule[currentRule] += 1;
-        }
-        // apply the next rule. 30% random, rest max strength
-        if (distribution(gen) < 3) {
-            currentRule = distribution(gen);
-        } else {
-            for (auto rule_strength: learnRule) {
-                if (rule_strength.second > learnRule[currentRule]) {
-                    currentRule = rule_strength.first;
-                }
-            }
-        }
-        this->traderAction = eval(currentRule, stockPrice, market, this->wealth->cash, this->wealth->shares);
-        if (traderAction == 1) {
-            this->wealth->buyStock(stockPrice);
-        } else if (traderAction == 2) {
-            this->wealth->sellStock(stockPrice);
-        }
+        this->phase = TRADER_PHASE;
+    }
+
+    void attach(TraderPopulation* population, size_t index) {
+        this->population = population;
+        this->index = index;
+    }
+
+    bool isAttachedTo(const TraderPopulation* population) const {
+        return this->population == population;
+    }
+
+    void inform(double stockPrice, double dividend, const std::vector<int>& market) {
+        this->population->inform(this->index, stockPrice, dividend, market);
     }
 
     void updateMarket(DMAMarket* market) {
@@ -151,25 +172,63 @@ public:
 
     virtual int step() {
         // std::cout << "DMA trader agent " << id << " runs!"<< std::endl;
-        int act = this->traderAction;
-        (this->market)->traderAction(act);
+        if (this->market->isFusedRound()) {
+            return 1;
+        }
+        int act = this->population->action[this->index];
+        (this->market)->traderAction(this->index, act);
         // std::cout << "DMA trader agent " << id << " completes!"<< std::endl;
         return 1;
     }
 };
 
+void DMAMarket::updateTraders(std::vector<DMATrader*> traders) {
+    for (const auto & trader : traders) {
+        if (!trader->isAttachedTo(&this->population)) {
+            trader->attach(&this->population, this->population.add(trader->id, 1000));
+            this->traders.push_back(trader);
+        }
+    }
+    int totalTraders = (this->traders).size();
+    this->stock->setPriceAdjustmentFactor(0.1 / totalTraders);
+}
+
 int DMAMarket::step() {
     // std::cout << "DMA Market agent runs!"<< std::endl;
+    PerfSample perfStart;
+    if (this->perfCounters) {
+        perfStart = threadPerfCounters().read();
+        this->workerPerf.assign(this->numThreads, PerfSample::zero());
+    }
     std::vector<int> stockInfo = stock->getStockStates(stockPrice, dividend);
     this->dividend = stock->getDividend();
-    for (const auto & trader : this->traders) {
-        // std::cout << "DMA Market agent informs trader " << trader->id << std::endl;
-        trader->inform(this->stockPrice, this->dividend, stockInfo);
-    }
+    this->workerOrders.assign(this->numThreads, {0, 0});
+    this->pool->run([&](int worker) {
+        // worker 0 is this thread, counted for the whole step
+        bool countWorker = this->perfCounters && worker > 0;
+        PerfSample workerStart = countWorker ? threadPerfCounters().read() : PerfSample();
+        auto range = WorkerPool::partition(this->population.size(), worker, this->numThreads);
+        this->workerOrders[worker] = this->population.informRange(range.first, range.second, this->stockPrice, this->dividend, stockInfo);
+        if (countWorker) {
+            this->workerPerf[worker] = threadPerfCounters().read() - workerStart;
+        }
+    });
+    // the price reflects the orders of earlier rounds only, as when the
+    // traders submit this round's orders after the market has stepped
     this->stockPrice = this->stock->priceAdjustment(buyOrders, sellOrders);
+    if (this->fused) {
+        this->addWorkerOrders();
+    }
     this->dividend = this->stock->getDividend();
+    if (this->perfCounters) {
+        PerfSample sample = threadPerfCounters().read() - perfStart;
+        for (const auto & workerSample : this->workerPerf) {
+            sample += workerSample;
+        }
+        this->stepPerf.push_back(sample);
+    }
     // std::cout << "DMA Market agent completes!"<< std::endl;
     return 1;
 }
 
-#endif
\ No newline at end of file
+#endif
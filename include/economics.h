@@ -4,6 +4,18 @@
 #include <random>
 #include <numeric>
 #include <vector>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <deque>
+#include <functional>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "agentRng.h"
 
 const int INCREASE = 1;
 const int DECREASE = 2;
@@ -13,70 +25,340 @@ const int BUY = 1;
 const int SELL = 2;
 const int NO_ACTION = 3;
 
+// Execution phases of the market models: each round the markets step, then
+// the traders, so every trader sees the price of the current round
+const int MARKET_PHASE = 0;
+const int TRADER_PHASE = 1;
+
+
+// Mean and variance of the last `capacity` values, kept as running sums over
+// a ring buffer. The sums are recomputed from the buffer once per wrap-around
+// so floating point drift stays bounded; that costs O(1) amortized per push.
+class RollingWindow {
+private:
+    std::vector<double> values;
+    size_t head = 0;
+    size_t count = 0;
+    double sum = 0;
+    double sumSquares = 0;
+
+public:
+    RollingWindow(size_t capacity) : values(std::max<size_t>(capacity, 1), 0.0) {}
+
+    void push(double value) {
+        if (this->count >= this->values.size()) {
+            this->sum -= this->values[this->head];
+            this->sumSquares -= this->values[this->head] * this->values[this->head];
+        }
+        this->values[this->head] = value;
+        this->sum += value;
+        this->sumSquares += value * value;
+        this->head = (this->head + 1) % this->values.size();
+        this->count += 1;
+        if (this->head == 0) {
+            this->sum = 0;
+            this->sumSquares = 0;
+            for (const auto & v : this->values) {
+                this->sum += v;
+                this->sumSquares += v * v;
+            }
+        }
+    }
+
+    bool full() const {
+        return this->count >= this->values.size();
+    }
+
+    double mean() const {
+        return this->sum / std::min(this->count, this->values.size());
+    }
+
+    double variance() const {
+        double n = static_cast<double>(std::min(this->count, this->values.size()));
+        double m = this->sum / n;
+        return std::max(0.0, this->sumSquares / n - m * m);
+    }
+
+    // The value pushed capacity - 1 pushes ago, once the window is full
+    double oldest() const {
+        return this->values[this->head];
+    }
+};
+
+enum class IndicatorKind {
+    SMA,        // simple moving average over the window
+    EMA,        // exponential moving average with alpha = 2 / (window + 1)
+    Volatility, // standard deviation over the window
+    Momentum,   // price minus the price `window` rounds ago
+    Min,        // lowest price over the window
+    Max         // highest price over the window
+};
+
+struct IndicatorSpec {
+    IndicatorKind kind;
+    int window;
+};
+
+// A price signal updated in O(1) (amortized for Min and Max) per round
+class Indicator {
+public:
+    virtual ~Indicator() {}
+    // Feed the round's price; returns false while the window is still filling
+    virtual bool update(double price) = 0;
+    virtual double value() const = 0;
+};
+
+class SMAIndicator: public Indicator {
+private:
+    RollingWindow window;
+
+public:
+    SMAIndicator(int window) : window(window) {}
+
+    virtual bool update(double price) {
+        this->window.push(price);
+        return this->window.full();
+    }
+
+    virtual double value() const {
+        return this->window.mean();
+    }
+};
+
+class EMAIndicator: public Indicator {
+private:
+    double alpha;
+    int window;
+    int seen = 0;
+    double average = 0;
+
+public:
+    EMAIndicator(int window) : alpha(2.0 / (window + 1)), window(window) {}
+
+    virtual bool update(double price) {
+        this->average = this->seen == 0 ? price : this->average + this->alpha * (price - this->average);
+        this->seen = std::min(this->seen + 1, this->window);
+        return this->seen >= this->window;
+    }
+
+    virtual double value() const {
+        return this->average;
+    }
+};
+
+class VolatilityIndicator: public Indicator {
+private:
+    RollingWindow window;
+
+public:
+    VolatilityIndicator(int window) : window(window) {}
+
+    virtual bool update(double price) {
+        this->window.push(price);
+        return this->window.full();
+    }
+
+    virtual double value() const {
+        return std::sqrt(this->window.variance());
+    }
+};
+
+class MomentumIndicator: public Indicator {
+private:
+    RollingWindow window;
+    double momentum = 0;
+
+public:
+    MomentumIndicator(int window) : window(window + 1) {}
+
+    virtual bool update(double price) {
+        this->window.push(price);
+        if (!this->window.full()) {
+            return false;
+        }
+        this->momentum = price - this->window.oldest();
+        return true;
+    }
+
+    virtual double value() const {
+        return this->momentum;
+    }
+};
+
+// Lowest (or highest) price over the window from a monotonic queue of
+// (round, price); every price is pushed and popped at most once
+template <typename Compare>
+class WindowExtremeIndicator: public Indicator {
+private:
+    long window;
+    long round = 0;
+    std::deque<std::pair<long, double>> candidates;
+    Compare better;
+
+public:
+    WindowExtremeIndicator(int window) : window(std::max(window, 1)) {}
+
+    virtual bool update(double price) {
+        while (!this->candidates.empty() && !this->better(this->candidates.back().second, price)) {
+            this->candidates.pop_back();
+        }
+        this->candidates.emplace_back(this->round, price);
+        if (this->candidates.front().first <= this->round - this->window) {
+            this->candidates.pop_front();
+        }
+        this->round += 1;
+        return this->round >= this->window;
+    }
+
+    virtual double value() const {
+        return this->candidates.front().second;
+    }
+};
+
+using MinIndicator = WindowExtremeIndicator<std::less<double>>;
+using MaxIndicator = WindowExtremeIndicator<std::greater<double>>;
+
+// A configured set of indicators. Each round every indicator is updated once
+// and its trend against its previous value (INCREASE, DECREASE or NO_CHANGE,
+// NO_CHANGE while its window fills) is packed into two bits of a bitfield:
+// indicator i occupies bits 2i and 2i+1.
+class IndicatorSet {
+public:
+    static constexpr size_t MAX_INDICATORS = 32;
+
+private:
+    std::vector<std::unique_ptr<Indicator>> indicators;
+    std::vector<double> lastValues;
+    uint64_t bits = 0;
+
+    static std::unique_ptr<Indicator> make(const IndicatorSpec& spec) {
+        switch (spec.kind) {
+            case IndicatorKind::SMA:
+                return std::make_unique<SMAIndicator>(spec.window);
+            case IndicatorKind::EMA:
+                return std::make_unique<EMAIndicator>(spec.window);
+            case IndicatorKind::Volatility:
+                return std::make_unique<VolatilityIndicator>(spec.window);
+            case IndicatorKind::Momentum:
+                return std::make_unique<MomentumIndicator>(spec.window);
+            case IndicatorKind::Min:
+                return std::make_unique<MinIndicator>(spec.window);
+            case IndicatorKind::Max:
+                return std::make_unique<MaxIndicator>(spec.window);
+        }
+        throw std::invalid_argument("unknown indicator kind");
+    }
+
+public:
+    IndicatorSet() {}
+
+    IndicatorSet(const std::vector<IndicatorSpec>& specs) {
+        if (specs.size() > MAX_INDICATORS) {
+            throw std::invalid_argument("at most 32 indicators fit in the state bitfield");
+        }
+        for (const auto & spec : specs) {
+            this->indicators.push_back(make(spec));
+        }
+        this->lastValues.assign(specs.size(), 0.0);
+    }
+
+    size_t size() const {
+        return this->indicators.size();
+    }
+
+    uint64_t update(double price) {
+        this->bits = 0;
+        for (size_t i = 0; i < this->indicators.size(); i++) {
+            if (!this->indicators[i]->update(price)) {
+                continue;
+            }
+            double current = this->indicators[i]->value();
+            uint64_t trend = NO_CHANGE;
+            if (current > this->lastValues[i]) {
+                trend = INCREASE;
+            } else if (current < this->lastValues[i]) {
+                trend = DECREASE;
+            }
+            this->bits |= trend << (2 * i);
+            this->lastValues[i] = current;
+        }
+        return this->bits;
+    }
+
+    uint64_t getBits() const {
+        return this->bits;
+    }
+
+    double value(size_t index) const {
+        return this->indicators[index]->value();
+    }
+
+    static int state(uint64_t bits, size_t index) {
+        return static_cast<int>((bits >> (2 * index)) & 3);
+    }
+};
 
 class Stock {
 private:
-    std::vector<double> prices;
+    // indicators reported by getStockStates; the 10- and 50-round SMAs by default
+    IndicatorSet indicators = IndicatorSet({{IndicatorKind::SMA, 10}, {IndicatorKind::SMA, 50}});
+    // full price history, only written when requested with streamPriceHistory
+    std::unique_ptr<std::ofstream> priceHistory;
     double priceAdjustmentFactor = 0.01;
     double currentPrice = 100;
     double lastDividend = 0;
-    double last10Avg = 0;
-    double last50Avg = 0;
 
     int dividendState = NO_CHANGE;
-    int last10AvgState = NO_CHANGE;
-    int last50AvgState = NO_CHANGE;
     
-    // Mersenne twister PRNG, initialized with seed from previous random device instance
-    std::mt19937 gen; 
+    // dividend stream, derived from the master seed and the owning market's id
+    AgentRng gen; 
     std::normal_distribution<double> distribution;
     
 public:
-    Stock(double priceAdjustmentFactor){
+    Stock(double priceAdjustmentFactor, int marketId = 0){
         this -> priceAdjustmentFactor = priceAdjustmentFactor;
             
-        std::random_device rd; 
-        // Mersenne twister PRNG, initialized with seed from previous random device instance
-        std::mt19937 gen(rd()); 
-        this->gen = gen;
+        this->gen = AgentRng::stream(getMasterSeed(), RNG_STOCK_STREAM, static_cast<uint64_t>(marketId));
         std::normal_distribution<double> distribution(0.0, 1.0);
         this->distribution = distribution;
     }
 
-    void updateAvg() {
-        int time = prices.size();
-        if (time < 10) {
-            this->last10AvgState = NO_CHANGE;
-        } else {
-            double avg10 = std::accumulate(prices.end()-10, prices.end(), 0.0) / 10;
-            if (avg10 > last10Avg) {
-                this->last10AvgState = INCREASE;
-            } else if (avg10 == last10Avg) {
-                this->last10AvgState = NO_CHANGE;
-            } else {
-                this->last10AvgState = DECREASE;
-            }
-            this->last10Avg = avg10;
-        } 
+    // Price moves by this fraction of the price per net order
+    void setPriceAdjustmentFactor(double priceAdjustmentFactor) {
+        this->priceAdjustmentFactor = priceAdjustmentFactor;
+    }
 
-        if (time < 50) {
-            this->last50AvgState = NO_CHANGE;
-        } else {
-            double avg50 = std::accumulate(prices.end()-50, prices.end(), 0.0) / 50;
-            if (avg50 > last50Avg) {
-                this->last50AvgState = INCREASE;
-            } else if (avg50 == last50Avg) {
-                this->last50AvgState = NO_CHANGE;
-            } else {
-                this->last50AvgState = DECREASE;
-            }
-            this->last50Avg = avg50;
+    // Append every price seen from now on to the given file, one per line at
+    // full precision
+    void streamPriceHistory(const std::string& path) {
+        this->priceHistory = std::make_unique<std::ofstream>(path);
+        if (!this->priceHistory->is_open()) {
+            this->priceHistory.reset();
+            throw std::runtime_error("cannot open price history file " + path);
         }
+        this->priceHistory->precision(std::numeric_limits<double>::max_digits10);
     }
 
+    // Replace the indicators reported after the dividend state. The trader
+    // rules read the trends of the first two, so at least two are required.
+    void configureIndicators(const std::vector<IndicatorSpec>& specs) {
+        if (specs.size() < 2) {
+            throw std::invalid_argument("a stock needs at least two indicators");
+        }
+        this->indicators = IndicatorSet(specs);
+    }
+
+    // Two bits per configured indicator, see IndicatorSet
+    uint64_t getIndicatorBits() const {
+        return this->indicators.getBits();
+    }
+
+    // The dividend trend followed by the trend of every configured indicator
     std::vector<int> getStockStates(double price, double dividend){
         this->currentPrice = price;
-        this->prices.push_back(price);
+        if (this->priceHistory) {
+            *this->priceHistory << price << '\n';
+        }
         if (dividend > this->lastDividend) {
             dividendState = INCREASE;
         } else if (dividend < this->lastDividend){
@@ -85,8 +367,11 @@ public:
             dividendState = NO_CHANGE;
         }
         this->lastDividend = dividend; 
-        updateAvg();
-        std::vector<int> states = {dividendState, last10AvgState, last50AvgState};
+        uint64_t bits = this->indicators.update(price);
+        std::vector<int> states = {dividendState};
+        for (size_t i = 0; i < this->indicators.size(); i++) {
+            states.push_back(IndicatorSet::state(bits, i));
+        }
         return states;
     }
 
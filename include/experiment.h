@@ -0,0 +1,228 @@
+#ifndef EXPERIMENT_H
+#define EXPERIMENT_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "simulation.h"
+#include "agentRng.h"
+#include "econDMAAgents.h"
+#include "econMPIAgents.h"
+#include "workerPool.h"
+
+enum class EconMode { DMA, MPI };
+
+inline std::string modeName(EconMode mode) {
+    return mode == EconMode::DMA ? "dma" : "mpi";
+}
+
+// Every combination of these values is run once per replica
+struct SweepSpec {
+    std::vector<int> traderCounts = {999, 9999, 99999};
+    std::vector<int> rounds = {200};
+    std::vector<EconMode> modes = {EconMode::DMA};
+    std::vector<uint64_t> seeds = {1};
+    int replicas = 1;
+    // threads each simulation steps its agents with
+    int threadsPerRun = 1;
+};
+
+struct ExperimentConfig {
+    EconMode mode = EconMode::DMA;
+    int traders = 0;
+    int rounds = 0;
+    uint64_t seed = 0;
+    int replica = 0;
+    int threads = 1;
+};
+
+struct ExperimentResult {
+    ExperimentConfig config;
+    double finalPrice = 0;
+    int buyOrders = 0;
+    int sellOrders = 0;
+    double wallMs = 0;
+    RunStats stats;
+};
+
+// Master seed of one replica; replicas of a seed draw unrelated streams
+inline uint64_t replicaSeed(uint64_t seed, int replica) {
+    uint64_t mix = seed ^ (static_cast<uint64_t>(replica) * 0xd1b54a32d192ed03ULL);
+    return splitmix64(mix);
+}
+
+// Configurations of a sweep, in the order of the result table: by mode,
+// trader count, rounds, seed and then replica
+inline std::vector<ExperimentConfig> expandSweep(const SweepSpec& spec) {
+    std::vector<ExperimentConfig> configs;
+    for (const auto & mode : spec.modes) {
+        for (const auto & traders : spec.traderCounts) {
+            for (const auto & rounds : spec.rounds) {
+                for (const auto & seed : spec.seeds) {
+                    for (int replica = 0; replica < spec.replicas; replica++) {
+                        configs.push_back({mode, traders, rounds, seed, replica, std::max(1, spec.threadsPerRun)});
+                    }
+                }
+            }
+        }
+    }
+    return configs;
+}
+
+template <typename Market, typename Trader>
+ExperimentResult runMarket(const ExperimentConfig& config) {
+    int traderIdOffset = 1;
+    Simulate simulation({}, config.rounds, config.threads);
+    simulation.setVerbose(false);
+    Market& market = simulation.emplaceAgents<Market>(1, 0)[0];
+    if constexpr (std::is_same<Market, DMAMarket>::value) {
+        // the market fans inform and the order tally out over its own threads
+        market.setThreads(config.threads);
+    }
+    AgentPool<Trader>& traderAgents = simulation.emplaceAgents<Trader>(config.traders, traderIdOffset);
+    std::vector<Trader*> traders = {};
+    for (auto & trader : traderAgents) {
+        trader.updateMarket(&market);
+        traders.push_back(&trader);
+    }
+    market.updateTraders(traders);
+
+    ExperimentResult result;
+    result.stats = simulation.run();
+    result.config = config;
+    result.finalPrice = market.getStockPrice();
+    result.buyOrders = market.getBuyOrders();
+    result.sellOrders = market.getSellOrders();
+    result.wallMs = result.stats.totalNs / 1e6;
+    return result;
+}
+
+// Run one configuration in a simulation of its own. The master seed is
+// thread-local, so the run only depends on its configuration, whatever else
+// runs on other threads.
+inline ExperimentResult runExperiment(const ExperimentConfig& config) {
+    uint64_t previousSeed = getMasterSeed();
+    setMasterSeed(replicaSeed(config.seed, config.replica));
+    ExperimentResult result = config.mode == EconMode::DMA ?
+        runMarket<DMAMarket, DMATrader>(config) : runMarket<MPIMarket, MPITrader>(config);
+    setMasterSeed(previousSeed);
+    return result;
+}
+
+// Run every configuration of the sweep, up to jobs at a time; results are in
+// expandSweep order
+inline std::vector<ExperimentResult> runSweep(const SweepSpec& spec, int jobs) {
+    std::vector<ExperimentConfig> configs = expandSweep(spec);
+    std::vector<ExperimentResult> results(configs.size());
+    jobs = std::max(1, std::min<int>(jobs, configs.size()));
+    std::atomic<size_t> next(0);
+    WorkerPool pool(jobs);
+    pool.run([&](int) {
+        for (size_t i = next++; i < configs.size(); i = next++) {
+            results[i] = runExperiment(configs[i]);
+        }
+    });
+    return results;
+}
+
+inline void printResults(std::ostream& out, const std::vector<ExperimentResult>& results) {
+    out << std::left << std::setw(6) << "mode" << std::right << std::setw(9) << "traders" << std::setw(8) << "rounds"
+        << std::setw(22) << "seed" << std::setw(9) << "replica" << std::setw(9) << "threads" << std::setw(14) << "final_price"
+        << std::setw(12) << "buy_orders" << std::setw(12) << "sell_orders" << std::setw(12) << "messages"
+        << std::setw(12) << "wall_ms" << std::setw(14) << "ms_per_round" << std::endl;
+    for (const auto & result : results) {
+        const ExperimentConfig& config = result.config;
+        out << std::left << std::setw(6) << modeName(config.mode) << std::right << std::setw(9) << config.traders
+            << std::setw(8) << config.rounds << std::setw(22) << config.seed << std::setw(9) << config.replica
+            << std::setw(9) << config.threads << std::setw(14) << std::fixed << std::setprecision(4) << result.finalPrice
+            << std::setw(12) << result.buyOrders << std::setw(12) << result.sellOrders
+            << std::setw(12) << result.stats.messages() << std::setw(12) << std::setprecision(1) << result.wallMs
+            << std::setw(14) << std::setprecision(3) << result.stats.meanRoundNs() / 1e6 << std::endl;
+        out.unsetf(std::ios_base::floatfield);
+    }
+}
+
+namespace detail {
+    template <typename T, typename Parse>
+    std::vector<T> parseList(const std::string& text, Parse parse) {
+        std::vector<T> values;
+        std::stringstream stream(text);
+        std::string item;
+        while (std::getline(stream, item, ',')) {
+            values.push_back(parse(item));
+        }
+        if (values.empty()) {
+            throw std::invalid_argument("empty list");
+        }
+        return values;
+    }
+
+    inline int parsePositive(const std::string& text) {
+        size_t used = 0;
+        int value = std::stoi(text, &used);
+        if (used != text.size() || value < 1) {
+            throw std::invalid_argument("expected a positive integer, got " + text);
+        }
+        return value;
+    }
+
+    // Unsigned decimal seed
+    inline uint64_t parseSeed(const std::string& text) {
+        size_t used = 0;
+        uint64_t seed = text.empty() || text[0] == '-' ? 0 : std::stoull(text, &used);
+        if (used == 0 || used != text.size()) {
+            throw std::invalid_argument("expected a seed, got " + text);
+        }
+        return seed;
+    }
+
+    // "dma" or "mpi", as printed by modeName
+    inline EconMode parseMode(const std::string& name) {
+        if (name != "dma" && name != "mpi") {
+            throw std::invalid_argument("unknown mode " + name);
+        }
+        return name == "dma" ? EconMode::DMA : EconMode::MPI;
+    }
+}
+
+// Sweep from command-line options, each overriding the default of SweepSpec:
+// --traders 999,9999 --rounds 200 --modes dma,mpi --seeds 1,2 --replicas 3
+// --threads 1. --jobs sets how many configurations run at once and is left
+// unchanged when not given.
+inline SweepSpec parseSweepArgs(int argc, char** argv, int& jobs) {
+    SweepSpec spec;
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (i + 1 >= argc) {
+            throw std::invalid_argument("missing value for " + option);
+        }
+        std::string value = argv[++i];
+        if (option == "--traders") {
+            spec.traderCounts = detail::parseList<int>(value, detail::parsePositive);
+        } else if (option == "--rounds") {
+            spec.rounds = detail::parseList<int>(value, detail::parsePositive);
+        } else if (option == "--modes") {
+            spec.modes = detail::parseList<EconMode>(value, detail::parseMode);
+        } else if (option == "--seeds") {
+            spec.seeds = detail::parseList<uint64_t>(value, detail::parseSeed);
+        } else if (option == "--replicas") {
+            spec.replicas = detail::parsePositive(value);
+        } else if (option == "--threads") {
+            spec.threadsPerRun = detail::parsePositive(value);
+        } else if (option == "--jobs") {
+            jobs = detail::parsePositive(value);
+        } else {
+            throw std::invalid_argument("unknown option " + option);
+        }
+    }
+    return spec;
+}
+#endif
@@ -0,0 +1,139 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware events counted around the phases of a round
+enum PerfEvent { PERF_CYCLES = 0, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_BRANCH_MISSES, PERF_EVENTS };
+
+inline const char* perfEventName(int event) {
+    static const char* names[PERF_EVENTS] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+    return names[event];
+}
+
+// Event counts over some span of execution; -1 for an event that could not
+// be counted, e.g. without a PMU or with a restrictive perf_event_paranoid
+struct PerfSample {
+    std::array<int64_t, PERF_EVENTS> counts = {-1, -1, -1, -1};
+
+    static PerfSample zero() {
+        PerfSample sample;
+        sample.counts.fill(0);
+        return sample;
+    }
+
+    bool available(int event) const {
+        return this->counts[event] >= 0;
+    }
+
+    bool anyAvailable() const {
+        for (int event = 0; event < PERF_EVENTS; event++) {
+            if (this->available(event)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Counts of both samples where both are available
+    PerfSample& operator+=(const PerfSample& other) {
+        for (int event = 0; event < PERF_EVENTS; event++) {
+            bool both = this->available(event) && other.available(event);
+            this->counts[event] = both ? this->counts[event] + other.counts[event] : -1;
+        }
+        return *this;
+    }
+
+    // Events counted between an earlier reading and this one
+    PerfSample operator-(const PerfSample& earlier) const {
+        PerfSample delta;
+        for (int event = 0; event < PERF_EVENTS; event++) {
+            bool both = this->available(event) && earlier.available(event);
+            delta.counts[event] = both ? this->counts[event] - earlier.counts[event] : -1;
+        }
+        return delta;
+    }
+};
+
+// User-space event counters of the calling thread, through perf_event_open.
+// Events the kernel or the machine do not support are left out, so reading
+// never fails; it just reports them as unavailable. Counts are scaled when
+// the kernel multiplexes counters.
+class PerfCounters {
+private:
+    std::array<int, PERF_EVENTS> fds = {-1, -1, -1, -1};
+
+public:
+    PerfCounters() {
+#if defined(__linux__)
+        static const uint64_t configs[PERF_EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int event = 0; event < PERF_EVENTS; event++) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[event];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // this thread only, on any CPU
+            this->fds[event] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters() {
+#if defined(__linux__)
+        for (auto & fd : this->fds) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    bool available() const {
+        for (const auto & fd : this->fds) {
+            if (fd >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Counts since the counters were opened
+    PerfSample read() const {
+        PerfSample sample;
+#if defined(__linux__)
+        for (int event = 0; event < PERF_EVENTS; event++) {
+            uint64_t values[3];
+            if (this->fds[event] < 0 || ::read(this->fds[event], values, sizeof(values)) != sizeof(values)) {
+                continue;
+            }
+            // values: count, time enabled, time running
+            double scale = values[2] > 0 ? static_cast<double>(values[1]) / values[2] : 0;
+            sample.counts[event] = static_cast<int64_t>(values[0] * scale);
+        }
+#endif
+        return sample;
+    }
+};
+
+// Counters of the calling thread, opened on first use
+inline const PerfCounters& threadPerfCounters() {
+    thread_local PerfCounters counters;
+    return counters;
+}
+#endif
@@ -0,0 +1,174 @@
+#ifndef RUN_STATS_H
+#define RUN_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <ostream>
+#include <vector>
+
+#include "perfCounters.h"
+
+// Messages routed at the end of one round. Bytes count the message records
+// moved through the engine's queues: a Message per direct message or
+// broadcast, sizeof(T) per typed one.
+struct MessageVolume {
+    size_t messages = 0;
+    size_t broadcasts = 0;
+    size_t bytes = 0;
+};
+
+// Timings of one round in nanoseconds. Deliver picks the agents due and
+// groups them by phase, step runs every phase on the workers, and collect
+// sorts the round's messages into the next round's inboxes and runs the
+// round-end hooks. stepBusyNs sums the time every worker spent stepping; it
+// measures how busy the workers were, not a speedup over a serial run.
+struct RoundStats {
+    int round = 0;
+    size_t agentsStepped = 0;
+    int64_t deliverNs = 0;
+    int64_t stepNs = 0;
+    int64_t stepBusyNs = 0;
+    int64_t collectNs = 0;
+    int64_t totalNs = 0;
+    MessageVolume volume;
+    // hardware events of each part when counters are enabled; the step
+    // events are summed over the workers
+    PerfSample deliverPerf;
+    PerfSample stepPerf;
+    PerfSample collectPerf;
+};
+
+// What Simulate::run measured, one entry per round that ran
+class RunStats {
+public:
+    int threads = 1;
+    size_t agents = 0;
+    int64_t totalNs = 0;
+    // whether the rounds carry hardware event counts
+    bool perfCounters = false;
+    std::vector<RoundStats> rounds;
+
+    // Events of one part of the round summed over all rounds, e.g.
+    // totalPerf(&RoundStats::stepPerf)
+    PerfSample totalPerf(PerfSample RoundStats::* part) const {
+        PerfSample total = PerfSample::zero();
+        for (const auto & round : this->rounds) {
+            total += round.*part;
+        }
+        return total;
+    }
+
+    size_t agentsStepped() const {
+        size_t stepped = 0;
+        for (const auto & round : this->rounds) {
+            stepped += round.agentsStepped;
+        }
+        return stepped;
+    }
+
+    size_t messages() const {
+        size_t messages = 0;
+        for (const auto & round : this->rounds) {
+            messages += round.volume.messages + round.volume.broadcasts;
+        }
+        return messages;
+    }
+
+    // Fraction of the workers' step time spent stepping agents, 1 when no
+    // worker waits at a phase barrier. Speedup over the serial path needs a
+    // run with one thread to compare against, as econBench does.
+    double stepUtilization() const {
+        int64_t busy = 0;
+        int64_t available = 0;
+        for (const auto & round : this->rounds) {
+            busy += round.stepBusyNs;
+            available += round.stepNs * this->threads;
+        }
+        return available == 0 ? 0 : static_cast<double>(busy) / available;
+    }
+
+    int64_t meanRoundNs() const {
+        int64_t total = 0;
+        for (const auto & round : this->rounds) {
+            total += round.totalNs;
+        }
+        return this->rounds.empty() ? 0 : total / static_cast<int64_t>(this->rounds.size());
+    }
+
+    // One line per round after a header. With counters, every part gets a
+    // column per event, -1 where the event is unavailable.
+    void writeCsv(std::ostream& out) const {
+        out << "round,agents_stepped,deliver_ns,step_ns,step_busy_ns,collect_ns,total_ns,messages,broadcasts,message_bytes";
+        if (this->perfCounters) {
+            for (const char* part : {"deliver", "step", "collect"}) {
+                for (int event = 0; event < PERF_EVENTS; event++) {
+                    out << ',' << part << '_' << perfEventName(event);
+                }
+            }
+        }
+        out << '\n';
+        for (const auto & round : this->rounds) {
+            out << round.round << ',' << round.agentsStepped << ',' << round.deliverNs << ',' << round.stepNs << ','
+                << round.stepBusyNs << ',' << round.collectNs << ',' << round.totalNs << ',' << round.volume.messages << ','
+                << round.volume.broadcasts << ',' << round.volume.bytes;
+            if (this->perfCounters) {
+                for (const PerfSample* sample : {&round.deliverPerf, &round.stepPerf, &round.collectPerf}) {
+                    for (const auto & count : sample->counts) {
+                        out << ',' << count;
+                    }
+                }
+            }
+            out << '\n';
+        }
+    }
+
+    // {"cycles":...,...} with null for unavailable events
+    static void writePerfJson(std::ostream& out, const PerfSample& sample) {
+        out << "{";
+        for (int event = 0; event < PERF_EVENTS; event++) {
+            out << (event > 0 ? "," : "") << "\"" << perfEventName(event) << "\":";
+            if (sample.available(event)) {
+                out << sample.counts[event];
+            } else {
+                out << "null";
+            }
+        }
+        out << "}";
+    }
+
+    void writeJson(std::ostream& out) const {
+        out << "{\"threads\":" << this->threads << ",\"agents\":" << this->agents << ",\"total_ns\":" << this->totalNs
+            << ",\"rounds\":[";
+        for (size_t i = 0; i < this->rounds.size(); i++) {
+            const RoundStats& round = this->rounds[i];
+            out << (i > 0 ? "," : "") << "{\"round\":" << round.round << ",\"agents_stepped\":" << round.agentsStepped
+                << ",\"deliver_ns\":" << round.deliverNs << ",\"step_ns\":" << round.stepNs
+                << ",\"step_busy_ns\":" << round.stepBusyNs << ",\"collect_ns\":" << round.collectNs
+                << ",\"total_ns\":" << round.totalNs << ",\"messages\":" << round.volume.messages
+                << ",\"broadcasts\":" << round.volume.broadcasts << ",\"message_bytes\":" << round.volume.bytes;
+            if (this->perfCounters) {
+                out << ",\"perf\":{\"deliver\":";
+                writePerfJson(out, round.deliverPerf);
+                out << ",\"step\":";
+                writePerfJson(out, round.stepPerf);
+                out << ",\"collect\":";
+                writePerfJson(out, round.collectPerf);
+                out << "}";
+            }
+            out << "}";
+        }
+        out << "]";
+        if (this->perfCounters) {
+            out << ",\"perf\":{\"deliver\":";
+            writePerfJson(out, this->totalPerf(&RoundStats::deliverPerf));
+            out << ",\"step\":";
+            writePerfJson(out, this->totalPerf(&RoundStats::stepPerf));
+            out << ",\"collect\":";
+            writePerfJson(out, this->totalPerf(&RoundStats::collectPerf));
+            out << "}";
+        }
+        out << "}\n";
+    }
+};
+#endif
@@ -7,56 +7,591 @@
 #include <vector>
 #include <deque>
 #include <climits>
+#include <cstdint>
 #include <chrono>
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <functional>
+#include <iterator>
+#include <initializer_list>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <new>
+
+#include "workerPool.h"
+#include "runStats.h"
+#include "traceRecorder.h"
+
+// Message content of doubles. Payloads of up to INLINE_CAPACITY values, such
+// as a trader action or the market state, are stored inline; larger ones
+// spill to a heap block.
+class Payload {
+    public:
+        static constexpr size_t INLINE_CAPACITY = 6;
+
+    private:
+        size_t length = 0;
+        double inlineValues[INLINE_CAPACITY];
+        std::unique_ptr<double[]> heapValues;
+
+        void assign(const double* values, size_t count) {
+            this->length = count;
+            if (count > INLINE_CAPACITY) {
+                this->heapValues.reset(new double[count]);
+                std::copy(values, values + count, this->heapValues.get());
+            } else {
+                this->heapValues.reset();
+                std::copy(values, values + count, this->inlineValues);
+            }
+        }
+
+    public:
+        Payload() {}
+        Payload(const double* values, size_t count) {
+            assign(values, count);
+        }
+        Payload(const std::vector<double>& values) {
+            assign(values.data(), values.size());
+        }
+        Payload(std::initializer_list<double> values) {
+            assign(values.begin(), values.size());
+        }
+
+        Payload(const Payload& other) {
+            assign(other.data(), other.size());
+        }
+        Payload(Payload&& other) noexcept {
+            *this = std::move(other);
+        }
+        Payload& operator=(const Payload& other) {
+            if (this != &other) {
+                assign(other.data(), other.size());
+            }
+            return *this;
+        }
+        Payload& operator=(Payload&& other) noexcept {
+            if (this != &other) {
+                this->length = other.length;
+                this->heapValues = std::move(other.heapValues);
+                if (!this->heapValues) {
+                    std::copy(other.inlineValues, other.inlineValues + other.length, this->inlineValues);
+                }
+                other.length = 0;
+            }
+            return *this;
+        }
+
+        size_t size() const {
+            return this->length;
+        }
+        bool empty() const {
+            return this->length == 0;
+        }
+        bool isInline() const {
+            return !this->heapValues;
+        }
+        const double* data() const {
+            return this->heapValues ? this->heapValues.get() : this->inlineValues;
+        }
+        const double* begin() const {
+            return data();
+        }
+        const double* end() const {
+            return data() + this->length;
+        }
+        double operator[](size_t index) const {
+            return data()[index];
+        }
+        std::vector<double> toVector() const {
+            return std::vector<double>(begin(), end());
+        }
+};
+
+inline bool operator==(const Payload& lhs, const Payload& rhs) {
+    return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+}
+
+inline bool operator==(const Payload& lhs, const std::vector<double>& rhs) {
+    return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end());
+}
+
+inline bool operator==(const std::vector<double>& lhs, const Payload& rhs) {
+    return rhs == lhs;
+}
 
 class Message {
     private:
-        std::vector<double> content;
+        Payload content;
+        // immutable payload shared by every copy, used for broadcasts
+        std::shared_ptr<const Payload> sharedContent;
     
     public:
-        Message(const std::vector<double>& value) {
-            this->content = value;
+        Message() {}
+        Message(const std::vector<double>& value) : content(value) {}
+        Message(std::initializer_list<double> value) : content(value) {}
+        Message(Payload&& value) : content(std::move(value)) {}
+
+        // A message whose copies all point at one payload, so copying it costs
+        // a reference count increment instead of a payload copy
+        static Message shared(Payload value) {
+            Message message;
+            message.sharedContent = std::make_shared<const Payload>(std::move(value));
+            return message;
+        }
+
+        Message toShared() const {
+            return this->sharedContent ? *this : Message::shared(this->content);
+        }
+
+        bool isShared() const {
+            return this->sharedContent != nullptr;
         }
-        const std::vector<double>* getContent() const {
-            return &content;
+
+        const Payload* getContent() const {
+            return sharedContent ? sharedContent.get() : &content;
         }
 };
 
+// Compressed-sparse-row inbox store: the inbox of slot i is
+// values[offsets[i], offsets[i + 1]). Message deliveries use InboxCSR<Message>
+// and every typed message queue uses InboxCSR<T>.
+template <typename T>
+class InboxCSR {
+private:
+    // one offset per slot plus the end, so an empty store has a single 0
+    std::vector<size_t> offsets = std::vector<size_t>(1, 0);
+    std::vector<size_t> cursors;
+    std::vector<T> values;
+
+public:
+    void reset(size_t slots) {
+        this->offsets.assign(slots + 1, 0);
+        this->values.clear();
+    }
+
+    size_t slots() const {
+        return this->offsets.size() - 1;
+    }
+
+    size_t count(int slot) const {
+        return this->offsets[slot + 1] - this->offsets[slot];
+    }
+
+    // Values in all inboxes
+    size_t size() const {
+        return this->values.size();
+    }
+
+    T* inbox(int slot) {
+        return this->values.data() + this->offsets[slot];
+    }
+
+    const T* inbox(int slot) const {
+        return this->values.data() + this->offsets[slot];
+    }
+
+    // Counting sort of the per-worker (recipient slot, value) lists by
+    // recipient. The sort is stable, so each inbox keeps worker order, which
+    // is sender id order. Slots that receive mail are appended to mailSlots.
+    void build(std::vector<std::vector<std::pair<int, T>>>& shards, std::vector<int>& mailSlots) {
+        size_t slots = this->slots();
+        std::fill(this->offsets.begin(), this->offsets.end(), 0);
+        size_t total = 0;
+        for (const auto & shard : shards) {
+            for (const auto & slot_value : shard) {
+                this->offsets[slot_value.first + 1] += 1;
+            }
+            total += shard.size();
+        }
+        for (size_t slot = 0; slot < slots; slot++) {
+            if (this->offsets[slot + 1] > 0) {
+                mailSlots.push_back(static_cast<int>(slot));
+            }
+            this->offsets[slot + 1] += this->offsets[slot];
+        }
+
+        this->cursors.assign(this->offsets.begin(), this->offsets.end() - 1);
+        this->values.resize(total);
+        for (auto & shard : shards) {
+            for (auto & slot_value : shard) {
+                this->values[this->cursors[slot_value.first]++] = std::move(slot_value.second);
+            }
+            shard.clear();
+        }
+    }
+};
+
+using MessageCSR = InboxCSR<Message>;
+
+// Small integer per typed message type, used to index the router's queues
+inline int nextMessageTypeIndex() {
+    static std::atomic<int> next(0);
+    return next.fetch_add(1);
+}
+
+template <typename T>
+int messageTypeIndex() {
+    static const int index = nextMessageTypeIndex();
+    return index;
+}
+
+class TypedQueueBase {
+public:
+    virtual ~TypedQueueBase() {}
+    virtual void resize(size_t slots, int workers) = 0;
+    // Sort the round's typed messages into the inboxes; recipients are
+    // appended to mailSlots, broadcast channels to broadcastChannels and the
+    // routed messages added to volume
+    virtual void build(std::vector<int>& mailSlots, std::vector<int>& broadcastChannels, MessageVolume& volume) = 0;
+};
+
+// Contiguous queues for one trivially copyable message type: per-worker send
+// lists and a CSR of the round's inboxes, plus the round's broadcasts.
+// Messages to a slot with a combiner are folded into one per-worker partial
+// as they are sent, and the partials into a single message at the barrier.
+template <typename T>
+class TypedQueue: public TypedQueueBase {
+    static_assert(std::is_trivially_copyable<T>::value, "typed messages must be trivially copyable");
+
+public:
+    InboxCSR<T> inboxes;
+    std::vector<std::vector<std::pair<int, T>>> shards;
+    std::vector<std::pair<int, T>> broadcasts;
+    std::vector<std::vector<std::pair<int, T>>> broadcastShards;
+    // slot -> index into combiners, or -1 when messages to it are not combined
+    std::vector<int> combinerIndex;
+    // (slot, fold(accumulator, message))
+    std::vector<std::pair<int, std::function<void(T&, const T&)>>> combiners;
+    // per worker, per combiner: (has value, partial)
+    std::vector<std::vector<std::pair<bool, T>>> partials;
+
+    virtual void resize(size_t slots, int workers) {
+        if (this->inboxes.slots() != slots) {
+            this->inboxes.reset(slots);
+        }
+        this->shards.resize(workers);
+        this->broadcastShards.resize(workers);
+        this->combinerIndex.assign(slots, -1);
+        this->combiners.clear();
+        this->partials.assign(workers, {});
+    }
+
+    void setCombiner(int slot, std::function<void(T&, const T&)> fold) {
+        if (this->combinerIndex[slot] >= 0) {
+            this->combiners[this->combinerIndex[slot]].second = fold;
+            return;
+        }
+        this->combinerIndex[slot] = static_cast<int>(this->combiners.size());
+        this->combiners.emplace_back(slot, fold);
+        for (auto & workerPartials : this->partials) {
+            workerPartials.emplace_back(false, T());
+        }
+    }
+
+    void send(int worker, int slot, const T& value) {
+        int index = this->combinerIndex[slot];
+        if (index < 0) {
+            this->shards[worker].emplace_back(slot, value);
+            return;
+        }
+        std::pair<bool, T>& partial = this->partials[worker][index];
+        if (partial.first) {
+            this->combiners[index].second(partial.second, value);
+        } else {
+            partial = {true, value};
+        }
+    }
+
+    virtual void build(std::vector<int>& mailSlots, std::vector<int>& broadcastChannels, MessageVolume& volume) {
+        // fold the partials in worker order, i.e. sender id order
+        for (size_t index = 0; index < this->combiners.size(); index++) {
+            bool hasValue = false;
+            T combined = T();
+            for (auto & workerPartials : this->partials) {
+                std::pair<bool, T>& partial = workerPartials[index];
+                if (!partial.first) {
+                    continue;
+                }
+                if (hasValue) {
+                    this->combiners[index].second(combined, partial.second);
+                } else {
+                    combined = partial.second;
+                    hasValue = true;
+                }
+                partial.first = false;
+            }
+            if (hasValue) {
+                this->shards[0].emplace_back(this->combiners[index].first, combined);
+            }
+        }
+        this->inboxes.build(this->shards, mailSlots);
+        this->broadcasts.clear();
+        for (auto & shard : this->broadcastShards) {
+            for (const auto & channel_value : shard) {
+                this->broadcasts.push_back(channel_value);
+                broadcastChannels.push_back(channel_value.first);
+            }
+            shard.clear();
+        }
+        volume.messages += this->inboxes.size();
+        volume.broadcasts += this->broadcasts.size();
+        volume.bytes += (this->inboxes.size() + this->broadcasts.size()) * sizeof(T);
+    }
+};
+
+// Owns one TypedQueue per message type. Queues are created on first use,
+// which may happen concurrently from several workers.
+class MessageRouter {
+public:
+    static constexpr int MAX_MESSAGE_TYPES = 32;
+
+private:
+    std::atomic<TypedQueueBase*> queues[MAX_MESSAGE_TYPES] = {};
+    std::vector<std::unique_ptr<TypedQueueBase>> ownedQueues;
+    std::mutex lock;
+    size_t slots = 0;
+    int workers = 1;
+
+public:
+    template <typename T>
+    TypedQueue<T>& queue() {
+        int index = messageTypeIndex<T>();
+        if (index >= MAX_MESSAGE_TYPES) {
+            throw std::length_error("too many typed message types");
+        }
+        TypedQueueBase* existing = this->queues[index].load(std::memory_order_acquire);
+        if (existing == nullptr) {
+            std::lock_guard<std::mutex> guard(this->lock);
+            existing = this->queues[index].load(std::memory_order_relaxed);
+            if (existing == nullptr) {
+                this->ownedQueues.push_back(std::make_unique<TypedQueue<T>>());
+                existing = this->ownedQueues.back().get();
+                existing->resize(this->slots, this->workers);
+                this->queues[index].store(existing, std::memory_order_release);
+            }
+        }
+        return static_cast<TypedQueue<T>&>(*existing);
+    }
+
+    void resize(size_t slots, int workers) {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->slots = slots;
+        this->workers = workers;
+        for (auto & queue : this->ownedQueues) {
+            queue->resize(slots, workers);
+        }
+    }
+
+    void build(std::vector<int>& mailSlots, std::vector<int>& broadcastChannels, MessageVolume& volume) {
+        for (auto & queue : this->ownedQueues) {
+            queue->build(mailSlots, broadcastChannels, volume);
+        }
+    }
+};
+
+// Type-erased combiner registered by an agent for messages addressed to it
+class CombinerBase {
+public:
+    virtual ~CombinerBase() {}
+    virtual void install(MessageRouter& router, int slot) const = 0;
+};
+
+template <typename T>
+class Combiner: public CombinerBase {
+private:
+    std::function<void(T&, const T&)> fold;
+
+public:
+    Combiner(std::function<void(T&, const T&)> fold) : fold(fold) {}
+
+    virtual void install(MessageRouter& router, int slot) const {
+        router.queue<T>().setCombiner(slot, this->fold);
+    }
+};
+
+class AgentTable;
+
+// Set by the engine while an agent steps: where its typed messages go
+struct StepContext {
+    // message shard of the stepping worker in the current phase
+    int worker = 0;
+    int slot = 0;
+    const AgentTable* table = nullptr;
+    MessageRouter* router = nullptr;
+};
+
 // Class declaration
 class Agent {
 private:
-    std::deque<Message> mailbox;
+    // Messages handed over with addToMailbox or left unread after a step.
+    // Empty until used, so idle agents own no message memory.
+    std::vector<Message> mailbox;
+    size_t mailboxHead = 0;
+    // This round's inbox: a view into the engine's message array, only valid
+    // while the agent steps
+    Message* inbox = nullptr;
+    size_t inboxSize = 0;
+    size_t inboxHead = 0;
+    // This round's broadcasts as (channel, message), shared by all agents
+    const std::vector<std::pair<int, Message>>* roundBroadcasts = nullptr;
+    size_t broadcastHead = 0;
+    const StepContext* context = nullptr;
+
+    bool nextBroadcast(Message& message) {
+        while (this->roundBroadcasts && this->broadcastHead < this->roundBroadcasts->size()) {
+            const std::pair<int, Message>& channel_message = (*this->roundBroadcasts)[this->broadcastHead];
+            this->broadcastHead += 1;
+            if (this->isSubscribed(channel_message.first)) {
+                message = channel_message.second;
+                return true;
+            }
+        }
+        return false;
+    }
 
 public:
     int id;
-    std::unordered_map<int, std::deque<Message>> outbox;
+    // Agents step in increasing phase order each round, with a barrier
+    // between phases, so an agent sees the side effects of every agent of an
+    // earlier phase. Agents of one phase step in parallel.
+    int phase = 0;
+    // (recipient id, message) in send order
+    std::vector<std::pair<int, Message>> outbox;
+    // (channel, message) in broadcast order
+    std::vector<std::pair<int, Message>> broadcasts;
+    // channels whose broadcasts this agent receives
+    std::vector<int> channels;
+    // reductions applied by the engine to typed messages addressed to this agent
+    std::vector<std::unique_ptr<CombinerBase>> combiners;
+    // called by the engine at the barrier after every round, in agent id order
+    std::vector<std::function<void()>> roundEndHooks;
 
     // Constructor
     Agent(int number) {
         this->id = number;
     }
 
+    virtual ~Agent() {}
+
     void send(int rid, const Message & message) {
-        auto it = this->outbox.find(rid);
-        if (it != this->outbox.end()) {
-            it->second.push_back(message);
-        } else {
-            std::deque<Message> msgs = {message};
-            this->outbox.emplace(rid, msgs);
-        }
+        this->outbox.emplace_back(rid, message);
         // std::cout << id << " sends a message to " << rid << std::endl;
         // printOutbox();
     }
+
+    void send(int rid, Message && message) {
+        this->outbox.emplace_back(rid, std::move(message));
+    }
     
-    void addToMailbox(std::deque<Message>& messages) {
+    // Publish one immutable payload to every subscriber of the channel. The
+    // engine routes it once, whatever the number of subscribers.
+    void broadcast(int channel, const Message & message) {
+        this->broadcasts.emplace_back(channel, message.toShared());
+    }
+
+    void subscribe(int channel) {
+        if (!this->isSubscribed(channel)) {
+            this->channels.push_back(channel);
+        }
+    }
+
+    bool isSubscribed(int channel) const {
+        return std::find(this->channels.begin(), this->channels.end(), channel) != this->channels.end();
+    }
+
+    // Send a trivially copyable value such as a struct of the model's fields.
+    // Typed messages are routed through per-type contiguous queues and can
+    // only be sent while the engine steps the agent.
+    template <typename T>
+    void sendTyped(int rid, const T& value);
+
+    template <typename T>
+    void broadcastTyped(int channel, const T& value);
+
+    // Register an associative fold(accumulator, message) for typed messages of
+    // type T addressed to this agent. The engine folds them while collecting,
+    // per worker, and delivers one combined message per round. The fold should
+    // also be commutative if results must not depend on the thread count.
+    template <typename T>
+    void combineTyped(std::function<void(T&, const T&)> fold) {
+        this->combiners.push_back(std::make_unique<Combiner<T>>(fold));
+    }
+
+    // Call fn(const T&) for every typed message delivered this round, direct
+    // ones first and then broadcasts on subscribed channels. Typed messages
+    // are only readable in the round they are delivered. Returns the count.
+    template <typename T, typename Fn>
+    size_t receiveTyped(Fn fn) const;
+
+    // Register fn to run once the round's steps have all returned, before the
+    // next round starts. Hooks run on one thread, so they can fold state that
+    // other agents wrote while stepping.
+    void atRoundEnd(std::function<void()> fn) {
+        this->roundEndHooks.push_back(fn);
+    }
+
+    void addToMailbox(const std::deque<Message>& messages) {
+        this->mailbox.insert(this->mailbox.end(), messages.begin(), messages.end());
+    }
+
+    void addToMailbox(const std::vector<Message>& messages) {
         this->mailbox.insert(this->mailbox.end(), messages.begin(), messages.end());
     }
 
+    void addToMailbox(std::vector<Message>&& messages) {
+        std::move(messages.begin(), messages.end(), std::back_inserter(this->mailbox));
+        messages.clear();
+    }
+
+    // Called by the engine before step() with the agent's slice of the round's
+    // messages and the round's broadcasts
+    void attachInbox(Message* messages, size_t count, const std::vector<std::pair<int, Message>>* broadcasts = nullptr,
+            const StepContext* context = nullptr) {
+        this->context = context;
+        this->inbox = messages;
+        this->inboxSize = count;
+        this->inboxHead = 0;
+        this->roundBroadcasts = broadcasts;
+        this->broadcastHead = 0;
+    }
+
+    // Called by the engine after step(); unread messages move to the mailbox
+    void detachInbox() {
+        for (size_t i = this->inboxHead; i < this->inboxSize; i++) {
+            this->mailbox.push_back(std::move(this->inbox[i]));
+        }
+        Message message;
+        while (this->nextBroadcast(message)) {
+            this->mailbox.push_back(message);
+        }
+        this->inbox = nullptr;
+        this->inboxSize = 0;
+        this->inboxHead = 0;
+        this->roundBroadcasts = nullptr;
+        this->broadcastHead = 0;
+        this->context = nullptr;
+    }
+
     std::optional<Message> receive() {
-        if (this->mailbox.size() > 0) {
-            Message removedMessage = this->mailbox.front();
-            this->mailbox.pop_front();
+        if (this->mailboxHead < this->mailbox.size()) {
+            Message removedMessage = std::move(this->mailbox[this->mailboxHead]);
+            this->mailboxHead += 1;
+            if (this->mailboxHead == this->mailbox.size()) {
+                this->mailbox.clear();
+                this->mailboxHead = 0;
+            }
+            return removedMessage;
+        } else if (this->inboxHead < this->inboxSize) {
+            Message removedMessage = std::move(this->inbox[this->inboxHead]);
+            this->inboxHead += 1;
             return removedMessage;
+        }
+        Message broadcastMessage;
+        if (this->nextBroadcast(broadcastMessage)) {
+            return broadcastMessage;
         } else {
             return std::nullopt;; // Return null in case mailbox is empty
         }
@@ -73,16 +608,11 @@ public:
     void printOutbox() {
         if (this->outbox.size() > 0) {
             for (const auto& pair : this->outbox) {
-                int key = pair.first;
-                const std::deque<Message>& messages = pair.second;
-
-                std::cout << "Key: " << key << std::endl;
-                for (const auto& message : messages) {
-                    std::cout << "Message ";
-                    const std::vector<double>* retrievedContent = message.getContent();
-                    for (const auto& element : *retrievedContent) {
-                        std::cout << element << " ";
-                    }
+                std::cout << "Key: " << pair.first << std::endl;
+                std::cout << "Message ";
+                const Payload* retrievedContent = pair.second.getContent();
+                for (const auto& element : *retrievedContent) {
+                    std::cout << element << " ";
                 }
             }
         } else {
@@ -91,10 +621,395 @@ public:
     }
 };
 
+// Dense, slot-indexed table of the agents in a simulation. Slots follow id
+// order, so a contiguous range of slots is a contiguous range of ids. Ids map
+// to slots by offset when they are contiguous, through a remap array when they
+// are moderately sparse, and through a hash map only when they are very sparse.
+class AgentTable {
+private:
+    std::vector<Agent*> slots;
+    int minId = 0;
+    bool contiguous = true;
+    std::vector<int> idToSlot;
+    std::unordered_map<int, int> sparseIdToSlot;
+
+public:
+    static constexpr int NO_SLOT = -1;
+
+    void build(const std::unordered_map<int, Agent*>& indexedAgents) {
+        this->slots.clear();
+        this->idToSlot.clear();
+        this->sparseIdToSlot.clear();
+        for (const auto & index_agent : indexedAgents) {
+            this->slots.push_back(index_agent.second);
+        }
+        std::sort(this->slots.begin(), this->slots.end(),
+            [](const Agent* a, const Agent* b) { return a->id < b->id; });
+        if (this->slots.empty()) {
+            this->contiguous = true;
+            return;
+        }
+
+        this->minId = this->slots.front()->id;
+        long span = static_cast<long>(this->slots.back()->id) - this->minId + 1;
+        this->contiguous = span == static_cast<long>(this->slots.size());
+        if (this->contiguous) {
+            return;
+        }
+        if (span <= 4 * static_cast<long>(this->slots.size())) {
+            this->idToSlot.assign(span, NO_SLOT);
+            for (size_t slot = 0; slot < this->slots.size(); slot++) {
+                this->idToSlot[this->slots[slot]->id - this->minId] = static_cast<int>(slot);
+            }
+        } else {
+            for (size_t slot = 0; slot < this->slots.size(); slot++) {
+                this->sparseIdToSlot.emplace(this->slots[slot]->id, static_cast<int>(slot));
+            }
+        }
+    }
+
+    size_t size() const {
+        return this->slots.size();
+    }
+
+    Agent* at(int slot) const {
+        return this->slots[slot];
+    }
+
+    int slotOf(int id) const {
+        long offset = static_cast<long>(id) - this->minId;
+        if (this->contiguous) {
+            return (offset >= 0 && offset < static_cast<long>(this->slots.size())) ? static_cast<int>(offset) : NO_SLOT;
+        }
+        if (!this->idToSlot.empty()) {
+            return (offset >= 0 && offset < static_cast<long>(this->idToSlot.size())) ? this->idToSlot[offset] : NO_SLOT;
+        }
+        auto it = this->sparseIdToSlot.find(id);
+        return it != this->sparseIdToSlot.end() ? it->second : NO_SLOT;
+    }
+};
+
+template <typename T>
+void Agent::sendTyped(int rid, const T& value) {
+    if (this->context == nullptr) {
+        throw std::logic_error("typed messages can only be sent while the agent is stepped");
+    }
+    int recipient = this->context->table->slotOf(rid);
+    if (recipient != AgentTable::NO_SLOT) {
+        this->context->router->template queue<T>().send(this->context->worker, recipient, value);
+    }
+}
+
+template <typename T>
+void Agent::broadcastTyped(int channel, const T& value) {
+    if (this->context == nullptr) {
+        throw std::logic_error("typed messages can only be sent while the agent is stepped");
+    }
+    this->context->router->template queue<T>().broadcastShards[this->context->worker].emplace_back(channel, value);
+}
+
+template <typename T, typename Fn>
+size_t Agent::receiveTyped(Fn fn) const {
+    if (this->context == nullptr) {
+        return 0;
+    }
+    const TypedQueue<T>& queue = this->context->router->template queue<T>();
+    size_t received = queue.inboxes.count(this->context->slot);
+    const T* values = queue.inboxes.inbox(this->context->slot);
+    for (size_t i = 0; i < received; i++) {
+        fn(values[i]);
+    }
+    for (const auto & channel_value : queue.broadcasts) {
+        if (this->isSubscribed(channel_value.first)) {
+            fn(channel_value.second);
+            received += 1;
+        }
+    }
+    return received;
+}
+
+// Owner's view of an AgentPool of any agent type
+class AgentPoolBase {
+public:
+    virtual ~AgentPoolBase() {}
+};
+
+// Fixed-capacity block of agents of one concrete type, stored contiguously.
+// The agents of a pool handed to Simulate::addPool are stepped through a
+// direct, inlinable call to T::step instead of the virtual Agent::step.
+template <typename T>
+class AgentPool: public AgentPoolBase {
+    static_assert(std::is_base_of<Agent, T>::value, "pooled agents must derive from Agent");
+
+private:
+    T* storage = nullptr;
+    size_t used = 0;
+    size_t capacity = 0;
+
+public:
+    AgentPool(size_t capacity) : storage(std::allocator<T>().allocate(capacity)), capacity(capacity) {}
+
+    AgentPool(const AgentPool&) = delete;
+    AgentPool& operator=(const AgentPool&) = delete;
+
+    ~AgentPool() {
+        for (size_t i = 0; i < this->used; i++) {
+            this->storage[i].~T();
+        }
+        std::allocator<T>().deallocate(this->storage, this->capacity);
+    }
+
+    // Construct the next agent of the pool in place
+    template <typename... Args>
+    T* emplace(Args&&... args) {
+        if (this->used == this->capacity) {
+            throw std::length_error("agent pool is full");
+        }
+        T* agent = new (this->storage + this->used) T(std::forward<Args>(args)...);
+        this->used += 1;
+        return agent;
+    }
+
+    size_t size() const {
+        return this->used;
+    }
+
+    T& operator[](size_t i) {
+        return this->storage[i];
+    }
+
+    T* begin() {
+        return this->storage;
+    }
+
+    T* end() {
+        return this->storage + this->used;
+    }
+};
+
+// How Simulate::run picks the agents to step in a round
+enum class Scheduler {
+    // step every agent every round and advance by the smallest proposed round
+    AllAgents,
+    // step only agents whose wake-up round is due or that have new mail
+    EventDriven
+};
+
 class Simulate {
 private:
-    std::unordered_map<int, std::deque<Message>> collectedMessages;
+    // Steps activeSlots[begin, end) on a worker, all agents of one type, and
+    // returns the smallest proposed round
+    using SlotStepper = int (Simulate::*)(size_t, size_t, int, StepContext&);
+
+    // agents of the pools given to addPool: the first and last agent of each
+    // pool, the stepper of its type and the type's name for traces
+    struct PoolRange {
+        const Agent* first;
+        const Agent* last;
+        SlotStepper stepper;
+        const char* typeName;
+    };
+    std::vector<PoolRange> pools;
+    // pools created by emplaceAgents, released with the simulation
+    std::vector<std::unique_ptr<AgentPoolBase>> ownedPools;
+    // stepper of every slot: its pool's, or the virtual fallback
+    std::vector<SlotStepper> slotSteppers;
+    std::vector<const char*> slotTypeNames;
+
+    // frozen messages of round N, read by the agents while they step
+    MessageCSR inboxes;
+    // per-worker (recipient slot, message) lists for round N+1, filled without
+    // locking and sorted into inboxes at the barrier
+    std::vector<std::vector<std::pair<int, Message>>> workerMessages;
+    // frozen broadcasts of round N and the per-worker (channel, message)
+    // lists for round N+1
+    std::vector<std::pair<int, Message>> roundBroadcasts;
+    std::vector<std::vector<std::pair<int, Message>>> workerBroadcasts;
+    // per-type queues of typed messages
+    MessageRouter router;
+    std::vector<StepContext> workerContexts;
+    std::vector<int> broadcastChannels;
+    // channel -> subscriber slots, used to wake subscribers in event-driven mode
+    std::unordered_map<int, std::vector<int>> channelSubscribers;
+    std::vector<const std::function<void()>*> roundEndHooks;
     int currentRound = 0;
+    int numThreads = 1;
+    // agents sorted by id; each worker steps one contiguous slice of slots
+    AgentTable table;
+    std::unique_ptr<WorkerPool> pool;
+
+    Scheduler scheduler = Scheduler::AllAgents;
+    // print the agent count and the average round time
+    bool verbose = true;
+    // read hardware event counters around every part of a round
+    bool perfCounters = false;
+    // spans of every round, worker slice and agent-type batch; null unless
+    // tracing is enabled
+    std::unique_ptr<TraceRecorder> trace;
+    // slots stepped in the current round, by phase and then slot; phase p
+    // covers activeSlots[phaseBounds[p], phaseBounds[p + 1])
+    std::vector<int> activeSlots;
+    std::vector<size_t> phaseBounds;
+    // scratch of groupByPhase
+    std::vector<size_t> phaseCursors;
+    std::vector<int> phaseOrdered;
+    // rank of every slot's phase among the distinct phases of the agents
+    std::vector<int> slotPhases;
+    int numPhases = 1;
+    // event-driven mode: (wake-up round, slot) min-heap; an entry is stale
+    // unless it matches wakeRounds[slot]
+    std::priority_queue<std::pair<int, int>, std::vector<std::pair<int, int>>, std::greater<std::pair<int, int>>> wakeQueue;
+    std::vector<int> wakeRounds;
+    // slots that received mail for the next round
+    std::vector<int> mailSlots;
+
+    void scheduleRound() {
+        // every slot is due every round, in the order run() grouped them in
+        if (this->scheduler == Scheduler::AllAgents) {
+            this->mailSlots.clear();
+            return;
+        }
+        this->collectDueSlots();
+        this->groupByPhase();
+    }
+
+    // Stable counting sort of activeSlots by phase rank, so phase p covers
+    // activeSlots[phaseBounds[p], phaseBounds[p + 1]) in slot order
+    void groupByPhase() {
+        this->phaseBounds.assign(this->numPhases + 1, 0);
+        if (this->numPhases == 1) {
+            this->phaseBounds[1] = this->activeSlots.size();
+            return;
+        }
+        for (const auto & slot : this->activeSlots) {
+            this->phaseBounds[this->slotPhases[slot] + 1] += 1;
+        }
+        for (int phase = 0; phase < this->numPhases; phase++) {
+            this->phaseBounds[phase + 1] += this->phaseBounds[phase];
+        }
+        this->phaseCursors.assign(this->phaseBounds.begin(), this->phaseBounds.end() - 1);
+        this->phaseOrdered.resize(this->activeSlots.size());
+        for (const auto & slot : this->activeSlots) {
+            this->phaseOrdered[this->phaseCursors[this->slotPhases[slot]]++] = slot;
+        }
+        this->activeSlots.swap(this->phaseOrdered);
+    }
+
+    // Slots due this round in event-driven mode, in increasing order
+    void collectDueSlots() {
+        this->activeSlots.clear();
+        while (!this->wakeQueue.empty() && this->wakeQueue.top().first <= this->currentRound) {
+            auto round_slot = this->wakeQueue.top();
+            this->wakeQueue.pop();
+            if (this->wakeRounds[round_slot.second] == round_slot.first) {
+                this->activeSlots.push_back(round_slot.second);
+            }
+        }
+        this->activeSlots.insert(this->activeSlots.end(), this->mailSlots.begin(), this->mailSlots.end());
+        this->mailSlots.clear();
+        std::sort(this->activeSlots.begin(), this->activeSlots.end());
+        this->activeSlots.erase(std::unique(this->activeSlots.begin(), this->activeSlots.end()), this->activeSlots.end());
+    }
+
+    void wakeSubscribers() {
+        for (const auto & channel : this->broadcastChannels) {
+            auto it = this->channelSubscribers.find(channel);
+            if (it != this->channelSubscribers.end()) {
+                this->mailSlots.insert(this->mailSlots.end(), it->second.begin(), it->second.end());
+            }
+        }
+    }
+
+    // The round the given number of rounds after round, INT_MAX (never) if
+    // that is past the last representable round
+    static int roundsAfter(int round, int rounds) {
+        return static_cast<int>(std::min<int64_t>(INT_MAX, static_cast<int64_t>(round) + rounds));
+    }
+
+    // Next round in which some agent is due, or INT_MAX when nothing is pending
+    int nextEventRound() {
+        if (!this->mailSlots.empty()) {
+            return this->currentRound + 1;
+        }
+        while (!this->wakeQueue.empty() && this->wakeRounds[this->wakeQueue.top().second] != this->wakeQueue.top().first) {
+            this->wakeQueue.pop();
+        }
+        return this->wakeQueue.empty() ? INT_MAX : this->wakeQueue.top().first;
+    }
+
+    // Step every agent of the slots with the same loop body. T is the exact
+    // type of the agents for pooled slots, so T::step is called directly and
+    // can be inlined; T is Agent for the virtual fallback.
+    template <typename T>
+    int stepSlots(size_t begin, size_t end, int shardIndex, StepContext& context) {
+        std::vector<std::pair<int, Message>>& shard = this->workerMessages[shardIndex];
+        int localProposedRound = INT_MAX;
+        for (size_t i = begin; i < end; i++) {
+            int slot = this->activeSlots[i];
+            T* agent = static_cast<T*>(this->table.at(slot));
+            // deliver messages to each agent
+            context.slot = slot;
+            agent->attachInbox(this->inboxes.inbox(slot), this->inboxes.count(slot), &this->roundBroadcasts, &context);
+            // execute each agent for 1 round
+            int proposedRound;
+            if constexpr (std::is_same<T, Agent>::value) {
+                proposedRound = agent->step();
+            } else {
+                proposedRound = agent->T::step();
+            }
+            agent->detachInbox();
+            if (proposedRound < localProposedRound) {
+                localProposedRound = proposedRound;
+            }
+            this->wakeRounds[slot] = roundsAfter(this->currentRound, std::max(1, proposedRound));
+            // collect sent messages from agent
+            for (auto & rid_message: agent->outbox) {
+                int recipient = this->table.slotOf(rid_message.first);
+                if (recipient != AgentTable::NO_SLOT) {
+                    shard.emplace_back(recipient, std::move(rid_message.second));
+                }
+            }
+            // clear agents' outbox
+            agent->outbox.clear();
+            for (auto & channel_message : agent->broadcasts) {
+                this->workerBroadcasts[shardIndex].push_back(std::move(channel_message));
+            }
+            agent->broadcasts.clear();
+        }
+        return localProposedRound;
+    }
+
+    void assignSteppers() {
+        std::less<const Agent*> before;
+        this->slotSteppers.assign(this->table.size(), &Simulate::stepSlots<Agent>);
+        this->slotTypeNames.assign(this->table.size(), traceTypeName<Agent>());
+        for (size_t slot = 0; slot < this->table.size(); slot++) {
+            const Agent* agent = this->table.at(slot);
+            for (const auto & pool : this->pools) {
+                if (!before(agent, pool.first) && !before(pool.last, agent)) {
+                    this->slotSteppers[slot] = pool.stepper;
+                    this->slotTypeNames[slot] = pool.typeName;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Number the distinct phases of the agents 0, 1, ... in increasing order
+    void rankPhases() {
+        std::vector<int> phases;
+        for (size_t slot = 0; slot < this->table.size(); slot++) {
+            phases.push_back(this->table.at(slot)->phase);
+        }
+        std::sort(phases.begin(), phases.end());
+        phases.erase(std::unique(phases.begin(), phases.end()), phases.end());
+        this->numPhases = std::max<int>(1, phases.size());
+        this->slotPhases.resize(this->table.size());
+        for (size_t slot = 0; slot < this->table.size(); slot++) {
+            int phase = this->table.at(slot)->phase;
+            this->slotPhases[slot] = std::lower_bound(phases.begin(), phases.end(), phase) - phases.begin();
+        }
+    }
 
 public:
     std::unordered_map<int, Agent*> indexedAgents;
@@ -103,26 +1018,114 @@ public:
     // Constructors
     Simulate(){}
 
-    Simulate(std::vector<Agent*> agents, int total) {
+    Simulate(std::vector<Agent*> agents, int total, int threads = 1) {
         for (auto agent : agents) {
             this->indexedAgents.emplace(agent->id, agent);
         }
         this->maxRounds = total;
+        this->numThreads = std::max(1, threads);
+    }
+
+    // Simulate the agents of a pool, stepped without virtual dispatch. The
+    // pool must outlive the simulation.
+    template <typename T>
+    void addPool(AgentPool<T>& pool) {
+        for (T& agent : pool) {
+            this->indexedAgents.emplace(agent.id, &agent);
+        }
+        if (pool.size() > 0) {
+            this->pools.push_back({&pool[0], &pool[pool.size() - 1], &Simulate::stepSlots<T>, traceTypeName<T>()});
+        }
+    }
+
+    // Construct count agents of type T with ids firstId, firstId + 1, ... in
+    // one contiguous block owned by the simulation, passing args to every
+    // constructor after the id. The agents are stepped as a pool and freed
+    // with the simulation in a single deallocation.
+    template <typename T, typename... Args>
+    AgentPool<T>& emplaceAgents(size_t count, int firstId, const Args&... args) {
+        auto pool = std::make_unique<AgentPool<T>>(count);
+        for (size_t i = 0; i < count; i++) {
+            pool->emplace(firstId + static_cast<int>(i), args...);
+        }
+        AgentPool<T>& agents = *pool;
+        this->ownedPools.push_back(std::move(pool));
+        this->addPool(agents);
+        return agents;
     }
 
     bool hasAgent(int id) {
         return this->indexedAgents.count(id) > 0;
     }
 
+    void setThreads(int threads) {
+        this->numThreads = std::max(1, threads);
+    }
+
+    int getThreads() const {
+        return this->numThreads;
+    }
+
+    // Quiet simulations print nothing, e.g. when several run concurrently
+    void setVerbose(bool verbose) {
+        this->verbose = verbose;
+    }
+
+    // Count cycles, instructions, LLC misses and branch misses of the deliver,
+    // step and collect parts of every round into the RunStats. Events the
+    // machine cannot count are reported as unavailable.
+    void setPerfCounters(bool enabled) {
+        this->perfCounters = enabled;
+    }
+
+    // Record the deliver, step and collect spans and the phases of every
+    // round, the slice of every worker in each phase and every batch of
+    // agents of one type into per-worker buffers of eventsPerThread events,
+    // allocated here. Events past a full buffer are dropped. A capacity of 0
+    // turns tracing off.
+    void setTracing(size_t eventsPerThread) {
+        if (eventsPerThread == 0) {
+            this->trace.reset();
+        } else {
+            this->trace = std::make_unique<TraceRecorder>(this->numThreads, eventsPerThread);
+        }
+    }
+
+    // Events recorded by the runs since tracing was enabled, or null
+    const TraceRecorder* getTrace() const {
+        return this->trace.get();
+    }
+
+    // Chrome trace-event JSON of the recorded events, for Perfetto or
+    // chrome://tracing
+    void writeTrace(std::ostream& out) const {
+        if (!this->trace) {
+            throw std::logic_error("Tracing is not enabled");
+        }
+        this->trace->writeChromeJson(out);
+    }
+
+    // In event-driven mode the value returned by step() is the number of
+    // rounds until the agent wants to run again; mail wakes it up earlier.
+    void setScheduler(Scheduler mode) {
+        this->scheduler = mode;
+    }
+
+    Scheduler getScheduler() const {
+        return this->scheduler;
+    }
+
     void printCollectedMessage() {
         std::cout << "Collected messages in round " << currentRound << std::endl;
-        for (const auto& pair : this->collectedMessages) {
-            int key = pair.first;
-            const std::deque<Message>& messages = pair.second;
-            std::cout << "Key: " << key << std::endl;
-            for (const auto& message : messages) {
+        for (size_t slot = 0; slot < this->inboxes.slots(); slot++) {
+            if (this->inboxes.count(slot) == 0) {
+                continue;
+            }
+            std::cout << "Key: " << this->table.at(slot)->id << std::endl;
+            for (size_t i = 0; i < this->inboxes.count(slot); i++) {
+                const Message& message = this->inboxes.inbox(slot)[i];
                 std::cout << "Message ";
-                const std::vector<double>* retrievedContent = message.getContent();
+                const Payload* retrievedContent = message.getContent();
                 for (const auto& element : *retrievedContent) {
                     std::cout << element << " ";
                 }
@@ -130,37 +1133,241 @@ public:
         }
     }
 
-    void run(){
+    // Rounds are bulk-synchronous. Phases step one after the other; in each
+    // phase every worker hands each agent of its slice a view of its inbox in
+    // the frozen round N message array, steps it and moves its outbox into
+    // the list of its worker and phase. At the barrier the lists are
+    // counting-sorted by recipient into the round N+1 array, keeping phase
+    // order and then worker order, i.e. sender id order, within each inbox.
+    // Delivery is therefore deterministic and independent of the thread
+    // count. Messages addressed to unknown agents are dropped during
+    // collection. Returns the timings and message volume of every round.
+    RunStats run(){
         auto initTime = std::chrono::high_resolution_clock::now();
-        std::cout << "Simulation has " << indexedAgents.size() << " agents " << std::endl;
+        if (this->verbose) {
+            std::cout << "Simulation has " << indexedAgents.size() << " agents " << std::endl;
+        }
 
+        this->table.build(this->indexedAgents);
+        if (this->inboxes.slots() != this->table.size()) {
+            this->inboxes.reset(this->table.size());
+        }
+        if (!this->pool || this->pool->size() != this->numThreads) {
+            this->pool = std::make_unique<WorkerPool>(this->numThreads);
+        }
+        this->rankPhases();
+        this->assignSteppers();
+        if (this->trace) {
+            this->trace->resize(this->numThreads);
+        }
+        TraceRecorder* trace = this->trace.get();
+        // one message shard per phase and worker, so collection keeps phase
+        // order and then sender id order for any thread count
+        int shards = this->numPhases * this->numThreads;
+        std::vector<int> proposedRounds(this->numThreads);
+        std::vector<std::chrono::nanoseconds> busyTimes(this->numThreads);
+        this->workerMessages.resize(shards);
+        this->workerBroadcasts.resize(shards);
+        this->router.resize(this->table.size(), shards);
+        this->workerContexts.resize(this->numThreads);
+        for (int worker = 0; worker < this->numThreads; worker++) {
+            this->workerContexts[worker].worker = worker;
+            this->workerContexts[worker].table = &this->table;
+            this->workerContexts[worker].router = &this->router;
+        }
+        for (size_t slot = 0; slot < this->table.size(); slot++) {
+            for (const auto & combiner : this->table.at(slot)->combiners) {
+                combiner->install(this->router, static_cast<int>(slot));
+            }
+        }
+        this->channelSubscribers.clear();
+        this->roundEndHooks.clear();
+        for (size_t slot = 0; slot < this->table.size(); slot++) {
+            for (const auto & channel : this->table.at(slot)->channels) {
+                this->channelSubscribers[channel].push_back(static_cast<int>(slot));
+            }
+            for (const auto & hook : this->table.at(slot)->roundEndHooks) {
+                this->roundEndHooks.push_back(&hook);
+            }
+        }
+
+        if (this->scheduler == Scheduler::AllAgents) {
+            // the slots stepped each round, grouped by phase once per run
+            this->activeSlots.clear();
+            for (size_t slot = 0; slot < this->table.size(); slot++) {
+                this->activeSlots.push_back(static_cast<int>(slot));
+            }
+            this->groupByPhase();
+        }
+        // every agent is due in the first round
+        this->wakeRounds.assign(this->table.size(), this->currentRound);
+        this->wakeQueue = {};
+        this->mailSlots.clear();
+        for (size_t slot = 0; slot < this->table.size(); slot++) {
+            if (this->scheduler == Scheduler::EventDriven) {
+                this->wakeQueue.emplace(this->currentRound, static_cast<int>(slot));
+            }
+            if (this->inboxes.count(slot) > 0) {
+                this->mailSlots.push_back(static_cast<int>(slot));
+            }
+        }
+
+        RunStats stats;
+        stats.threads = this->numThreads;
+        stats.agents = this->table.size();
+        stats.perfCounters = this->perfCounters;
+        // step events of every worker in the current round
+        std::vector<PerfSample> workerPerf(this->numThreads);
+        stats.rounds.reserve(std::max(0, maxRounds - currentRound));
         while (currentRound < maxRounds) {
             auto startTime = std::chrono::high_resolution_clock::now();
-            int aggregatedProposedRound = INT_MAX;
-            for (const auto & index_agent : indexedAgents) {
-                // deliver messages to each agent
-                index_agent.second->addToMailbox(this->collectedMessages[index_agent.first]);
-                this->collectedMessages.erase(index_agent.first);
-                // execute each agent for 1 round
-                int proposedRound = index_agent.second->step();
-                // collect sent messages from agent
-                for (const auto & index_message: index_agent.second->outbox) {
-                    for (const auto & msg: index_message.second) {
-                        this->collectedMessages[index_message.first].push_back(msg);
+            int64_t traceStart = trace ? trace->now() : 0;
+            PerfSample deliverStart = this->perfCounters ? threadPerfCounters().read() : PerfSample();
+
+            this->scheduleRound();
+
+            PerfSample deliverEnd = this->perfCounters ? threadPerfCounters().read() : PerfSample();
+            std::fill(workerPerf.begin(), workerPerf.end(), PerfSample::zero());
+            auto stepTime = std::chrono::high_resolution_clock::now();
+            int64_t traceStep = trace ? trace->now() : 0;
+            if (trace) {
+                trace->record(0, "deliver", "round", traceStart, traceStep, currentRound, this->activeSlots.size());
+            }
+            std::fill(proposedRounds.begin(), proposedRounds.end(), INT_MAX);
+            std::fill(busyTimes.begin(), busyTimes.end(), std::chrono::nanoseconds(0));
+            // phases run one after the other, each split over all workers
+            for (size_t phase = 0; phase + 1 < this->phaseBounds.size(); phase++) {
+                size_t phaseBegin = this->phaseBounds[phase];
+                size_t phaseEnd = this->phaseBounds[phase + 1];
+                if (phaseBegin == phaseEnd) {
+                    continue;
+                }
+                int phaseRank = static_cast<int>(phase);
+                int64_t tracePhaseStart = trace ? trace->now() : 0;
+                this->pool->run([&](int worker) {
+                    auto workerStart = std::chrono::high_resolution_clock::now();
+                    int64_t traceWorkerStart = trace ? trace->now() : 0;
+                    PerfSample perfStart = this->perfCounters ? threadPerfCounters().read() : PerfSample();
+                    auto range = WorkerPool::partition(phaseEnd - phaseBegin, worker, this->numThreads);
+                    int shardIndex = phaseRank * this->numThreads + worker;
+                    StepContext& context = this->workerContexts[worker];
+                    context.worker = shardIndex;
+                    int localProposedRound = INT_MAX;
+                    // step each run of consecutive slots of one agent type in one loop
+                    size_t i = phaseBegin + range.first;
+                    size_t last = phaseBegin + range.second;
+                    while (i < last) {
+                        SlotStepper stepper = this->slotSteppers[this->activeSlots[i]];
+                        size_t runEnd = i + 1;
+                        while (runEnd < last && this->slotSteppers[this->activeSlots[runEnd]] == stepper) {
+                            runEnd += 1;
+                        }
+                        int64_t traceBatchStart = trace ? trace->now() : 0;
+                        localProposedRound = std::min(localProposedRound, (this->*stepper)(i, runEnd, shardIndex, context));
+                        if (trace) {
+                            trace->record(worker, this->slotTypeNames[this->activeSlots[i]], "agents",
+                                traceBatchStart, trace->now(), currentRound, runEnd - i);
+                        }
+                        i = runEnd;
+                    }
+                    proposedRounds[worker] = std::min(proposedRounds[worker], localProposedRound);
+                    if (this->perfCounters) {
+                        workerPerf[worker] += threadPerfCounters().read() - perfStart;
                     }
+                    busyTimes[worker] += std::chrono::high_resolution_clock::now() - workerStart;
+                    if (trace) {
+                        trace->record(worker, "worker", "worker", traceWorkerStart, trace->now(), currentRound, phaseRank);
+                    }
+                });
+                if (trace) {
+                    trace->record(0, "phase", "round", tracePhaseStart, trace->now(), currentRound, phaseRank);
                 }
-                // clear agents' outbox
-                index_agent.second->outbox.clear();
-                if (proposedRound < aggregatedProposedRound) {
-                    aggregatedProposedRound = proposedRound;
+            }
+            auto collectTime = std::chrono::high_resolution_clock::now();
+            int64_t traceCollect = trace ? trace->now() : 0;
+            if (trace) {
+                trace->record(0, "step", "round", traceStep, traceCollect, currentRound, this->activeSlots.size());
+            }
+            PerfSample collectStart = this->perfCounters ? threadPerfCounters().read() : PerfSample();
+
+            // barrier: sort the collected messages into the round N+1 inboxes
+            MessageVolume volume;
+            this->inboxes.build(this->workerMessages, this->mailSlots);
+            this->roundBroadcasts.clear();
+            this->broadcastChannels.clear();
+            for (auto & shard : this->workerBroadcasts) {
+                for (auto & channel_message : shard) {
+                    this->broadcastChannels.push_back(channel_message.first);
+                    this->roundBroadcasts.push_back(std::move(channel_message));
+                }
+                shard.clear();
+            }
+            volume.messages = this->inboxes.size();
+            volume.broadcasts = this->roundBroadcasts.size();
+            volume.bytes = (volume.messages + volume.broadcasts) * sizeof(Message);
+            this->router.build(this->mailSlots, this->broadcastChannels, volume);
+            if (this->scheduler == Scheduler::EventDriven) {
+                this->wakeSubscribers();
+            }
+            for (const auto & hook : this->roundEndHooks) {
+                (*hook)();
+            }
+            PerfSample collectEnd = this->perfCounters ? threadPerfCounters().read() : PerfSample();
+            auto endTime = std::chrono::high_resolution_clock::now();
+            if (trace) {
+                trace->record(0, "collect", "round", traceCollect, trace->now(), currentRound, volume.messages + volume.broadcasts);
+            }
+
+            RoundStats round;
+            round.round = currentRound;
+            round.agentsStepped = this->activeSlots.size();
+            round.deliverNs = std::chrono::duration_cast<std::chrono::nanoseconds>(stepTime - startTime).count();
+            round.stepNs = std::chrono::duration_cast<std::chrono::nanoseconds>(collectTime - stepTime).count();
+            for (const auto & busy : busyTimes) {
+                round.stepBusyNs += busy.count();
+            }
+            round.collectNs = std::chrono::duration_cast<std::chrono::nanoseconds>(endTime - collectTime).count();
+            round.totalNs = std::chrono::duration_cast<std::chrono::nanoseconds>(endTime - startTime).count();
+            round.volume = volume;
+            if (this->perfCounters) {
+                round.deliverPerf = deliverEnd - deliverStart;
+                round.stepPerf = PerfSample::zero();
+                for (const auto & sample : workerPerf) {
+                    round.stepPerf += sample;
+                }
+                round.collectPerf = collectEnd - collectStart;
+            }
+            stats.rounds.push_back(round);
+
+            if (this->scheduler == Scheduler::AllAgents) {
+                int aggregatedProposedRound = *std::min_element(proposedRounds.begin(), proposedRounds.end());
+                currentRound = aggregatedProposedRound == INT_MAX ? maxRounds : roundsAfter(currentRound, aggregatedProposedRound);
+            } else {
+                for (const auto & slot : this->activeSlots) {
+                    this->wakeQueue.emplace(this->wakeRounds[slot], slot);
+                }
+                int nextRound = this->nextEventRound();
+                currentRound = nextRound == INT_MAX ? maxRounds : nextRound;
+            }
+        }
+        stats.totalNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - initTime).count();
+        if (this->verbose) {
+            std::cout << "Ran " << stats.rounds.size() << " rounds, average time per round: "
+                << stats.meanRoundNs() / 1e6 << " ms" << std::endl;
+            if (this->perfCounters) {
+                PerfSample step = stats.totalPerf(&RoundStats::stepPerf);
+                if (step.anyAvailable()) {
+                    std::cout << "Step events:";
+                    for (int event = 0; event < PERF_EVENTS; event++) {
+                        std::cout << " " << perfEventName(event) << "=" << step.counts[event];
+                    }
+                    std::cout << std::endl;
+                } else {
+                    std::cout << "Hardware event counters are unavailable" << std::endl;
                 }
             }
-            std::cout << "Round " << currentRound << " takes " << 
-                std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - startTime).count() << " ms" << std::endl;
-            currentRound += aggregatedProposedRound;
         }
-        std::cout << "Average time per round: " << 
-            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - initTime).count() / currentRound << " ms" << std::endl;
+        return stats;
     }
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,157 @@
+#ifndef TRACE_RECORDER_H
+#define TRACE_RECORDER_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#if defined(__GNUG__)
+#include <cxxabi.h>
+#endif
+
+// One span of engine activity. Names and categories point to static strings,
+// so recording copies a few words and never allocates.
+struct TraceEvent {
+    const char* name = nullptr;
+    const char* category = nullptr;
+    int64_t beginNs = 0;
+    int64_t endNs = 0;
+    int round = 0;
+    // agents in the span, or the phase of a worker's phase span
+    int64_t value = 0;
+};
+
+// Fixed-capacity event buffers, one per worker thread. Each buffer has a
+// single writer, the thread of its worker, so recording needs no locks or
+// atomics; readers must wait until the run is over. Events beyond the
+// capacity are counted and dropped.
+class TraceRecorder {
+private:
+    struct Buffer {
+        std::unique_ptr<TraceEvent[]> events;
+        size_t size = 0;
+        size_t dropped = 0;
+    };
+
+    std::vector<Buffer> buffers;
+    size_t capacity = 0;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+    static void writeString(std::ostream& out, const char* text) {
+        out << '"';
+        for (const char* c = text; *c != '\0'; c++) {
+            if (*c == '"' || *c == '\\') {
+                out << '\\';
+            }
+            out << *c;
+        }
+        out << '"';
+    }
+
+public:
+    // Readable form of a name from std::type_info::name
+    static std::string demangle(const char* name) {
+#if defined(__GNUG__)
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+        if (status == 0 && demangled != nullptr) {
+            std::string readable(demangled);
+            std::free(demangled);
+            return readable;
+        }
+#endif
+        return name;
+    }
+
+    TraceRecorder(int threads, size_t eventsPerThread) : capacity(eventsPerThread) {
+        this->resize(threads);
+    }
+
+    // Make sure there is a buffer for every worker; existing events are kept
+    void resize(int threads) {
+        while (static_cast<int>(this->buffers.size()) < threads) {
+            this->buffers.emplace_back();
+            this->buffers.back().events = std::make_unique<TraceEvent[]>(this->capacity);
+        }
+    }
+
+    int threads() const {
+        return static_cast<int>(this->buffers.size());
+    }
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->origin).count();
+    }
+
+    // Called by the thread of the given worker only
+    void record(int worker, const char* name, const char* category, int64_t beginNs, int64_t endNs, int round, int64_t value) {
+        Buffer& buffer = this->buffers[worker];
+        if (buffer.size == this->capacity) {
+            buffer.dropped += 1;
+            return;
+        }
+        buffer.events[buffer.size] = {name, category, beginNs, endNs, round, value};
+        buffer.size += 1;
+    }
+
+    size_t size() const {
+        size_t events = 0;
+        for (const auto & buffer : this->buffers) {
+            events += buffer.size;
+        }
+        return events;
+    }
+
+    size_t dropped() const {
+        size_t events = 0;
+        for (const auto & buffer : this->buffers) {
+            events += buffer.dropped;
+        }
+        return events;
+    }
+
+    void clear() {
+        for (auto & buffer : this->buffers) {
+            buffer.size = 0;
+            buffer.dropped = 0;
+        }
+    }
+
+    // Chrome trace-event JSON with one complete ("X") event per span and one
+    // track per worker, loadable in Perfetto and chrome://tracing
+    void writeChromeJson(std::ostream& out) const {
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        bool first = true;
+        for (size_t worker = 0; worker < this->buffers.size(); worker++) {
+            out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << worker
+                << ",\"args\":{\"name\":\"worker " << worker << "\"}}";
+            first = false;
+            const Buffer& buffer = this->buffers[worker];
+            for (size_t i = 0; i < buffer.size; i++) {
+                const TraceEvent& event = buffer.events[i];
+                out << ",\n{\"name\":";
+                writeString(out, event.name);
+                out << ",\"cat\":\"" << event.category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << worker
+                    << ",\"ts\":" << event.beginNs / 1000 << '.' << std::to_string(1000 + event.beginNs % 1000).substr(1)
+                    << ",\"dur\":" << (event.endNs - event.beginNs) / 1000 << '.'
+                    << std::to_string(1000 + (event.endNs - event.beginNs) % 1000).substr(1)
+                    << ",\"args\":{\"round\":" << event.round << ",\"value\":" << event.value << "}}";
+            }
+        }
+        out << "\n]}\n";
+    }
+};
+
+// Name of type T in trace events, demangled once and kept for the program's
+// lifetime, so events can point to it
+template <typename T>
+const char* traceTypeName() {
+    static const std::string name = TraceRecorder::demangle(typeid(T).name());
+    return name.c_str();
+}
+#endif
@@ -0,0 +1,477 @@
+#ifndef TRADER_POPULATION_H
+#define TRADER_POPULATION_H
+
+#include "economics.h"
+#include "agentRng.h"
+#include <array>
+#include <utility>
+#include <random>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Number of trading rules a trader chooses between, numbered 1..TRADER_RULES
+constexpr int TRADER_RULES = 5;
+
+// Strength of each rule of one trader, with the strongest rule kept up to
+// date as strengths are rewarded. Strengths only ever grow by one, so the
+// best rule is maintained in O(1) and rule selection needs no scan.
+template <int Rules = TRADER_RULES>
+class RuleStrengths {
+private:
+    std::array<int, Rules> strengths = {};
+    // first rule with the maximum strength
+    int best = 1;
+
+public:
+    void reward(int rule) {
+        int strength = this->strengths[rule - 1] += 1;
+        int bestStrength = this->strengths[this->best - 1];
+        if (strength > bestStrength || (strength == bestStrength && rule < this->best)) {
+            this->best = rule;
+        }
+    }
+
+    int strength(int rule) const {
+        return this->strengths[rule - 1];
+    }
+
+    int bestRule() const {
+        return this->best;
+    }
+
+    // The rule a scan over rules 1..Rules that switches to any strictly
+    // stronger rule ends on when it starts from current
+    int select(int current) const {
+        return this->strengths[current - 1] == this->strengths[this->best - 1] ? current : this->best;
+    }
+};
+
+// Structure-of-arrays state of a population of rule-learning traders. Trader i
+// is the i-th element of every array, so a round over the population is one
+// linear pass over a few contiguous arrays instead of a pointer chase per
+// trader.
+class TraderPopulation {
+public:
+    static constexpr int RULES = TRADER_RULES;
+
+    // action[rule][canBuy][canSell][draw < 3] for the current market state;
+    // rule 0 is "no rule" and never acts
+    using ActionTable = std::array<int, (RULES + 1) * 8>;
+
+    std::vector<int> ids;
+    std::vector<double> cash;
+    std::vector<double> shares;
+    std::vector<double> bankDeposit;
+    std::vector<double> wealth;
+    std::vector<int> currentRule;
+    std::vector<int> action;
+    // order each trader submitted to its market this round, 0 if none
+    std::vector<int> orders;
+    // strengths[r - 1][i] is the strength of rule r for trader i
+    std::array<std::vector<int>, RULES> strengths;
+    std::vector<AgentRng> gens;
+
+private:
+    // kernel scratch: the max-strength rule of each trader and its rule-4 draw
+    std::vector<int> preferredRule;
+    std::vector<int> draws;
+
+public:
+    // Append a trader with the same initial state as a WealthManagement of
+    // initWealth; returns its index
+    size_t add(int id, double initWealth) {
+        this->ids.push_back(id);
+        this->bankDeposit.push_back(0.5 * initWealth);
+        this->cash.push_back(initWealth - 0.5 * initWealth);
+        this->shares.push_back(0);
+        this->wealth.push_back(0);
+        this->currentRule.push_back(1);
+        this->action.push_back(0);
+        this->orders.push_back(0);
+        this->preferredRule.push_back(0);
+        this->draws.push_back(0);
+        for (auto & ruleStrengths : this->strengths) {
+            ruleStrengths.push_back(0);
+        }
+        this->gens.push_back(AgentRng::forAgent(id));
+        return this->ids.size() - 1;
+    }
+
+    size_t size() const {
+        return this->ids.size();
+    }
+
+    // Action of a rule given the market state, whether the trader can afford
+    // a share, whether it holds one, and whether its rule-4 draw is below 3
+    static int decide(int rule, const std::vector<int>& marketState, bool canBuy, bool canSell, bool lowDraw) {
+        int action = 0;
+        switch (rule) {
+            case 1:
+                if (marketState[0] == INCREASE && canBuy){
+                    action = 1;
+                } else if (marketState[0] == DECREASE && canSell) {
+                    action = 2;
+                }
+                break;
+            case 2:
+                if (marketState[1] == INCREASE && canSell){
+                    action = 2;
+                } else if (canBuy && marketState[2] == DECREASE){
+                    action = 1;
+                }
+                break;
+            case 3:
+                if (marketState[1] == INCREASE && canBuy){
+                    action = 1;
+                } else if (marketState[1] == INCREASE && canSell){
+                    action = 2;
+                }
+                break;
+            case 4:
+                if (lowDraw){
+                    if (canBuy) {
+                        action = 1;
+                    }
+                } else {
+                    if (canSell) {
+                        action = 2;
+                    }
+                }
+                break;
+            case 5:
+                if (marketState[2] == INCREASE && canSell){
+                    action = 2;
+                } else if (marketState[2] == DECREASE && canBuy){
+                    action = 1;
+                }
+                break;
+            default:
+                break;
+        }
+        return action;
+    }
+
+    static int eval(int rule, double stockPrice, const std::vector<int>& marketState, double cash, double shares, int draw) {
+        return decide(rule, marketState, stockPrice < cash, shares >= 1, draw < 3);
+    }
+
+    // The market state is the same for every trader in a round, so every
+    // rule's decision reduces to a lookup on (rule, canBuy, canSell, lowDraw)
+    static ActionTable actionTable(const std::vector<int>& marketState) {
+        ActionTable table = {};
+        for (int rule = 0; rule <= RULES; rule++) {
+            for (int flags = 0; flags < 8; flags++) {
+                table[rule * 8 + flags] = decide(rule, marketState, flags & 4, flags & 2, flags & 1);
+            }
+        }
+        return table;
+    }
+
+    // Same update as DMATrader::inform used to do on its own objects
+    void inform(size_t i, double stockPrice, double dividend, const std::vector<int>& market) {
+        std::uniform_int_distribution<int> distribution(1, RULES);
+        this->cash[i] += this->shares[i] * dividend;
+        double updatedWealth = stockPrice * this->shares[i] + this->bankDeposit[i] + this->cash[i];
+        // increase the strength if wealth has increased
+        if (updatedWealth > this->wealth[i]) {
+            this->strengths[this->currentRule[i] - 1][i] += 1;
+        }
+        // apply the next rule. 30% random, rest max strength
+        if (distribution(this->gens[i]) < 3) {
+            this->currentRule[i] = distribution(this->gens[i]);
+        } else {
+            for (int rule = 1; rule <= RULES; rule++) {
+                if (this->strengths[rule - 1][i] > this->strengths[this->currentRule[i] - 1][i]) {
+                    this->currentRule[i] = rule;
+                }
+            }
+        }
+        // only the random rule consumes a draw
+        int draw = this->currentRule[i] == 4 ? distribution(this->gens[i]) : 0;
+        this->action[i] = eval(this->currentRule[i], stockPrice, market, this->cash[i], this->shares[i], draw);
+        if (this->action[i] == 1) {
+            this->shares[i] += 1;
+            this->cash[i] -= stockPrice;
+        } else if (this->action[i] == 2) {
+            this->shares[i] -= 1;
+            this->cash[i] += stockPrice;
+        }
+    }
+
+    // Traders processed per block of informRange: their arrays fit in L1, so
+    // the passes over a block after the first hit cache
+    static constexpr size_t BLOCK = 256;
+
+    // Informs traders [begin, end) with the same results as calling inform on
+    // each of them and returns the (buy, sell) orders they decided on. The
+    // work is split in three passes: dividends, rewards and the max-strength
+    // rule (branch-free, vectorized), the random draws (scalar, each trader's
+    // generator is sequential), and the decision, bookkeeping and order count
+    // (a table lookup and masked updates, vectorized). The passes run block by
+    // block, so the range is streamed from memory once. Traders share no
+    // state, so disjoint ranges can be informed concurrently.
+    std::pair<int, int> informRange(size_t begin, size_t end, double stockPrice, double dividend, const std::vector<int>& market) {
+        ActionTable table = actionTable(market);
+        std::pair<int, int> orders = {0, 0};
+        for (size_t blockBegin = begin; blockBegin < end; blockBegin += BLOCK) {
+            size_t blockEnd = std::min(end, blockBegin + BLOCK);
+            rewardAndRank(blockBegin, blockEnd, stockPrice, dividend);
+            chooseRules(blockBegin, blockEnd);
+            std::pair<int, int> blockOrders = act(blockBegin, blockEnd, stockPrice, table);
+            orders.first += blockOrders.first;
+            orders.second += blockOrders.second;
+        }
+        return orders;
+    }
+
+    // One linear pass over the whole population
+    std::pair<int, int> informAll(double stockPrice, double dividend, const std::vector<int>& market) {
+        return informRange(0, this->size(), stockPrice, dividend, market);
+    }
+
+    // (buy orders, sell orders) submitted by traders [begin, end); clears
+    // their orders for the next round
+    std::pair<int, int> collectOrders(size_t begin, size_t end) {
+        int buyOrders = 0;
+        int sellOrders = 0;
+        for (size_t i = begin; i < end; i++) {
+            buyOrders += this->orders[i] == BUY;
+            sellOrders += this->orders[i] == SELL;
+            this->orders[i] = 0;
+        }
+        return {buyOrders, sellOrders};
+    }
+
+private:
+    void rewardAndRankScalar(size_t begin, size_t end, double stockPrice, double dividend) {
+        for (size_t i = begin; i < end; i++) {
+            this->cash[i] += this->shares[i] * dividend;
+            double updatedWealth = stockPrice * this->shares[i] + this->bankDeposit[i] + this->cash[i];
+            int reward = updatedWealth > this->wealth[i];
+            int current = this->currentRule[i];
+            int maxStrength = 0;
+            int currentStrength = 0;
+            for (int rule = 1; rule <= RULES; rule++) {
+                int strength = this->strengths[rule - 1][i] + (reward & (rule == current));
+                this->strengths[rule - 1][i] = strength;
+                maxStrength = std::max(maxStrength, strength);
+                currentStrength += (rule == current) * strength;
+            }
+            // the scan in inform ends on the first rule of max strength unless
+            // the current rule already has it
+            int best = RULES;
+            for (int rule = RULES; rule >= 1; rule--) {
+                best = this->strengths[rule - 1][i] == maxStrength ? rule : best;
+            }
+            this->preferredRule[i] = currentStrength == maxStrength ? current : best;
+        }
+    }
+
+    std::pair<int, int> actScalar(size_t begin, size_t end, double stockPrice, const ActionTable& table) {
+        int buyOrders = 0;
+        int sellOrders = 0;
+        for (size_t i = begin; i < end; i++) {
+            int flags = (stockPrice < this->cash[i]) * 4 + (this->shares[i] >= 1) * 2 + (this->draws[i] < 3);
+            int a = table[this->currentRule[i] * 8 + flags];
+            this->action[i] = a;
+            this->shares[i] = a == 1 ? this->shares[i] + 1 : (a == 2 ? this->shares[i] - 1 : this->shares[i]);
+            this->cash[i] = a == 1 ? this->cash[i] - stockPrice : (a == 2 ? this->cash[i] + stockPrice : this->cash[i]);
+            buyOrders += a == 1;
+            sellOrders += a == 2;
+        }
+        return {buyOrders, sellOrders};
+    }
+
+    void chooseRules(size_t begin, size_t end) {
+        std::uniform_int_distribution<int> distribution(1, RULES);
+        for (size_t i = begin; i < end; i++) {
+            int rule = distribution(this->gens[i]) < 3 ? distribution(this->gens[i]) : this->preferredRule[i];
+            this->currentRule[i] = rule;
+            this->draws[i] = rule == 4 ? distribution(this->gens[i]) : 0;
+        }
+    }
+
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+    // Eight traders per vector: their doubles fill a 512-bit register, their
+    // rules and strengths a 256-bit one, and comparisons yield mask registers
+    void rewardAndRank(size_t begin, size_t end, double stockPrice, double dividend) {
+        const size_t lanes = 8;
+        size_t i = begin;
+        __m512d price = _mm512_set1_pd(stockPrice);
+        __m512d div = _mm512_set1_pd(dividend);
+        __m256i one = _mm256_set1_epi32(1);
+        for (; i + lanes <= end; i += lanes) {
+            __m512d shares = _mm512_loadu_pd(&this->shares[i]);
+            __m512d cash = _mm512_add_pd(_mm512_loadu_pd(&this->cash[i]), _mm512_mul_pd(shares, div));
+            _mm512_storeu_pd(&this->cash[i], cash);
+            __m512d updatedWealth = _mm512_add_pd(
+                _mm512_add_pd(_mm512_mul_pd(price, shares), _mm512_loadu_pd(&this->bankDeposit[i])), cash);
+            __mmask8 reward = _mm512_cmp_pd_mask(updatedWealth, _mm512_loadu_pd(&this->wealth[i]), _CMP_GT_OQ);
+
+            __m256i current = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&this->currentRule[i]));
+            __m256i maxStrength = _mm256_setzero_si256();
+            __m256i currentStrength = _mm256_setzero_si256();
+            __m256i ruleStrengths[RULES];
+            for (int rule = 1; rule <= RULES; rule++) {
+                __mmask8 isCurrent = _mm256_cmpeq_epi32_mask(current, _mm256_set1_epi32(rule));
+                __m256i* slot = reinterpret_cast<__m256i*>(&this->strengths[rule - 1][i]);
+                __m256i strength = _mm256_loadu_si256(slot);
+                strength = _mm256_mask_add_epi32(strength, static_cast<__mmask8>(reward & isCurrent), strength, one);
+                _mm256_storeu_si256(slot, strength);
+                ruleStrengths[rule - 1] = strength;
+                maxStrength = _mm256_max_epi32(maxStrength, strength);
+                currentStrength = _mm256_mask_mov_epi32(currentStrength, isCurrent, strength);
+            }
+            __m256i best = _mm256_set1_epi32(RULES);
+            for (int rule = RULES; rule >= 1; rule--) {
+                __mmask8 isMax = _mm256_cmpeq_epi32_mask(ruleStrengths[rule - 1], maxStrength);
+                best = _mm256_mask_mov_epi32(best, isMax, _mm256_set1_epi32(rule));
+            }
+            __mmask8 keep = _mm256_cmpeq_epi32_mask(currentStrength, maxStrength);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&this->preferredRule[i]), _mm256_mask_mov_epi32(best, keep, current));
+        }
+        rewardAndRankScalar(i, end, stockPrice, dividend);
+    }
+
+    std::pair<int, int> act(size_t begin, size_t end, double stockPrice, const ActionTable& table) {
+        const size_t lanes = 8;
+        size_t i = begin;
+        __m512d price = _mm512_set1_pd(stockPrice);
+        __m512d one = _mm512_set1_pd(1.0);
+        int buyOrders = 0;
+        int sellOrders = 0;
+        for (; i + lanes <= end; i += lanes) {
+            __m512d cash = _mm512_loadu_pd(&this->cash[i]);
+            __m512d shares = _mm512_loadu_pd(&this->shares[i]);
+            __mmask8 canBuy = _mm512_cmp_pd_mask(price, cash, _CMP_LT_OQ);
+            __mmask8 canSell = _mm512_cmp_pd_mask(shares, one, _CMP_GE_OQ);
+            __mmask8 lowDraw = _mm256_cmplt_epi32_mask(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&this->draws[i])), _mm256_set1_epi32(3));
+            __m256i flags = _mm256_maskz_mov_epi32(canBuy, _mm256_set1_epi32(4));
+            flags = _mm256_mask_or_epi32(flags, canSell, flags, _mm256_set1_epi32(2));
+            flags = _mm256_mask_or_epi32(flags, lowDraw, flags, _mm256_set1_epi32(1));
+            __m256i rule = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&this->currentRule[i]));
+            __m256i index = _mm256_add_epi32(_mm256_slli_epi32(rule, 3), flags);
+            __m256i actions = _mm256_i32gather_epi32(table.data(), index, 4);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&this->action[i]), actions);
+
+            __mmask8 isBuy = _mm256_cmpeq_epi32_mask(actions, _mm256_set1_epi32(1));
+            __mmask8 isSell = _mm256_cmpeq_epi32_mask(actions, _mm256_set1_epi32(2));
+            buyOrders += __builtin_popcount(isBuy);
+            sellOrders += __builtin_popcount(isSell);
+            shares = _mm512_mask_add_pd(shares, isBuy, shares, one);
+            shares = _mm512_mask_sub_pd(shares, isSell, shares, one);
+            cash = _mm512_mask_sub_pd(cash, isBuy, cash, price);
+            cash = _mm512_mask_add_pd(cash, isSell, cash, price);
+            _mm512_storeu_pd(&this->shares[i], shares);
+            _mm512_storeu_pd(&this->cash[i], cash);
+        }
+        std::pair<int, int> orders = actScalar(i, end, stockPrice, table);
+        return {orders.first + buyOrders, orders.second + sellOrders};
+    }
+#elif defined(__AVX2__)
+    // 64-bit lane masks of four doubles narrowed to four 32-bit lane masks
+    static __m128i narrowMask(__m256d mask) {
+        __m256i packed = _mm256_permutevar8x32_epi32(_mm256_castpd_si256(mask), _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6));
+        return _mm256_castsi256_si128(packed);
+    }
+
+    static __m256d widenMask(__m128i mask) {
+        return _mm256_castsi256_pd(_mm256_cvtepi32_epi64(mask));
+    }
+
+    void rewardAndRank(size_t begin, size_t end, double stockPrice, double dividend) {
+        const size_t lanes = 4;
+        size_t i = begin;
+        __m256d price = _mm256_set1_pd(stockPrice);
+        __m256d div = _mm256_set1_pd(dividend);
+        for (; i + lanes <= end; i += lanes) {
+            __m256d shares = _mm256_loadu_pd(&this->shares[i]);
+            __m256d cash = _mm256_add_pd(_mm256_loadu_pd(&this->cash[i]), _mm256_mul_pd(shares, div));
+            _mm256_storeu_pd(&this->cash[i], cash);
+            __m256d updatedWealth = _mm256_add_pd(
+                _mm256_add_pd(_mm256_mul_pd(price, shares), _mm256_loadu_pd(&this->bankDeposit[i])), cash);
+            __m128i reward = narrowMask(_mm256_cmp_pd(updatedWealth, _mm256_loadu_pd(&this->wealth[i]), _CMP_GT_OQ));
+
+            __m128i current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&this->currentRule[i]));
+            __m128i maxStrength = _mm_setzero_si128();
+            __m128i currentStrength = _mm_setzero_si128();
+            __m128i ruleStrengths[RULES];
+            for (int rule = 1; rule <= RULES; rule++) {
+                __m128i isCurrent = _mm_cmpeq_epi32(current, _mm_set1_epi32(rule));
+                __m128i* slot = reinterpret_cast<__m128i*>(&this->strengths[rule - 1][i]);
+                // masks are -1, so subtracting one adds 1 where rewarded
+                __m128i strength = _mm_sub_epi32(_mm_loadu_si128(slot), _mm_and_si128(reward, isCurrent));
+                _mm_storeu_si128(slot, strength);
+                ruleStrengths[rule - 1] = strength;
+                maxStrength = _mm_max_epi32(maxStrength, strength);
+                currentStrength = _mm_or_si128(currentStrength, _mm_and_si128(isCurrent, strength));
+            }
+            __m128i best = _mm_set1_epi32(RULES);
+            for (int rule = RULES; rule >= 1; rule--) {
+                __m128i isMax = _mm_cmpeq_epi32(ruleStrengths[rule - 1], maxStrength);
+                best = _mm_blendv_epi8(best, _mm_set1_epi32(rule), isMax);
+            }
+            __m128i keep = _mm_cmpeq_epi32(currentStrength, maxStrength);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&this->preferredRule[i]), _mm_blendv_epi8(best, current, keep));
+        }
+        rewardAndRankScalar(i, end, stockPrice, dividend);
+    }
+
+    static int horizontalSum(__m128i v) {
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(v);
+    }
+
+    std::pair<int, int> act(size_t begin, size_t end, double stockPrice, const ActionTable& table) {
+        const size_t lanes = 4;
+        size_t i = begin;
+        __m256d price = _mm256_set1_pd(stockPrice);
+        __m256d one = _mm256_set1_pd(1.0);
+        __m128i buyCount = _mm_setzero_si128();
+        __m128i sellCount = _mm_setzero_si128();
+        for (; i + lanes <= end; i += lanes) {
+            __m256d cash = _mm256_loadu_pd(&this->cash[i]);
+            __m256d shares = _mm256_loadu_pd(&this->shares[i]);
+            __m128i canBuy = narrowMask(_mm256_cmp_pd(price, cash, _CMP_LT_OQ));
+            __m128i canSell = narrowMask(_mm256_cmp_pd(shares, one, _CMP_GE_OQ));
+            __m128i lowDraw = _mm_cmplt_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&this->draws[i])), _mm_set1_epi32(3));
+            __m128i flags = _mm_or_si128(_mm_or_si128(
+                _mm_and_si128(canBuy, _mm_set1_epi32(4)), _mm_and_si128(canSell, _mm_set1_epi32(2))),
+                _mm_and_si128(lowDraw, _mm_set1_epi32(1)));
+            __m128i rule = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&this->currentRule[i]));
+            __m128i index = _mm_add_epi32(_mm_slli_epi32(rule, 3), flags);
+            __m128i actions = _mm_i32gather_epi32(table.data(), index, 4);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&this->action[i]), actions);
+
+            __m128i isBuy = _mm_cmpeq_epi32(actions, _mm_set1_epi32(1));
+            __m128i isSell = _mm_cmpeq_epi32(actions, _mm_set1_epi32(2));
+            buyCount = _mm_sub_epi32(buyCount, isBuy);
+            sellCount = _mm_sub_epi32(sellCount, isSell);
+            __m256d buy = widenMask(isBuy);
+            __m256d sell = widenMask(isSell);
+            shares = _mm256_blendv_pd(shares, _mm256_add_pd(shares, one), buy);
+            shares = _mm256_blendv_pd(shares, _mm256_sub_pd(shares, one), sell);
+            cash = _mm256_blendv_pd(cash, _mm256_sub_pd(cash, price), buy);
+            cash = _mm256_blendv_pd(cash, _mm256_add_pd(cash, price), sell);
+            _mm256_storeu_pd(&this->shares[i], shares);
+            _mm256_storeu_pd(&this->cash[i], cash);
+        }
+        std::pair<int, int> orders = actScalar(i, end, stockPrice, table);
+        return {orders.first + horizontalSum(buyCount), orders.second + horizontalSum(sellCount)};
+    }
+#else
+    void rewardAndRank(size_t begin, size_t end, double stockPrice, double dividend) {
+        rewardAndRankScalar(begin, end, stockPrice, dividend);
+    }
+
+    std::pair<int, int> act(size_t begin, size_t end, double stockPrice, const ActionTable& table) {
+        return actScalar(begin, end, stockPrice, table);
+    }
+#endif
+};
+#endif
@@ -0,0 +1,119 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads. The calling thread acts as worker 0, so a
+// pool of size 1 spawns no threads and runs every job inline.
+class WorkerPool {
+private:
+    std::vector<std::thread> threads;
+    std::mutex lock;
+    std::condition_variable jobReady;
+    std::condition_variable jobDone;
+    std::function<void(int)> job;
+    long generation = 0;
+    int pending = 0;
+    bool stopping = false;
+    // first exception thrown by a worker during the current job
+    std::exception_ptr error;
+
+    void workerLoop(int worker) {
+        long seenGeneration = 0;
+        while (true) {
+            std::unique_lock<std::mutex> guard(this->lock);
+            this->jobReady.wait(guard, [&] { return this->stopping || this->generation != seenGeneration; });
+            if (this->stopping) {
+                return;
+            }
+            seenGeneration = this->generation;
+            guard.unlock();
+
+            std::exception_ptr thrown;
+            try {
+                this->job(worker);
+            } catch (...) {
+                thrown = std::current_exception();
+            }
+
+            guard.lock();
+            if (thrown && !this->error) {
+                this->error = thrown;
+            }
+            this->pending -= 1;
+            if (this->pending == 0) {
+                this->jobDone.notify_one();
+            }
+        }
+    }
+
+public:
+    WorkerPool(int size) {
+        for (int worker = 1; worker < size; worker++) {
+            this->threads.emplace_back(&WorkerPool::workerLoop, this, worker);
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->stopping = true;
+        }
+        this->jobReady.notify_all();
+        for (auto & thread : this->threads) {
+            thread.join();
+        }
+    }
+
+    int size() const {
+        return static_cast<int>(this->threads.size()) + 1;
+    }
+
+    // Run fn(worker) once on every worker and block until all of them return.
+    // If any of them throws, the first exception is rethrown here once every
+    // worker is done.
+    void run(const std::function<void(int)>& fn) {
+        if (this->threads.empty()) {
+            fn(0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(this->lock);
+            this->job = fn;
+            this->pending = static_cast<int>(this->threads.size());
+            this->generation += 1;
+        }
+        this->jobReady.notify_all();
+        std::exception_ptr thrown;
+        try {
+            fn(0);
+        } catch (...) {
+            thrown = std::current_exception();
+        }
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->jobDone.wait(guard, [&] { return this->pending == 0; });
+        if (!thrown) {
+            thrown = this->error;
+        }
+        this->error = nullptr;
+        if (thrown) {
+            std::rethrow_exception(thrown);
+        }
+    }
+
+    // Contiguous [begin, end) slice of n items assigned to the given worker
+    static std::pair<size_t, size_t> partition(size_t n, int worker, int workers) {
+        size_t begin = n * worker / workers;
+        size_t end = n * (worker + 1) / workers;
+        return {begin, end};
+    }
+};
+#endif
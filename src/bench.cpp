@@ -0,0 +1,53 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "benchmark.h"
+
+// Compare the DMA and message-passing economies over a grid of trader and
+// thread counts; prints one CSV or JSON record per configuration
+int main(int argc, char** argv) {
+    BenchSpec spec;
+    std::string format = "csv";
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string option = argv[i];
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("missing value for " + option);
+            }
+            std::string value = argv[++i];
+            if (option == "--modes") {
+                spec.modes = detail::parseList<EconMode>(value, detail::parseMode);
+            } else if (option == "--traders") {
+                spec.traderCounts = detail::parseList<int>(value, detail::parsePositive);
+            } else if (option == "--threads") {
+                spec.threadCounts = detail::parseList<int>(value, detail::parsePositive);
+            } else if (option == "--rounds") {
+                spec.rounds = detail::parsePositive(value);
+            } else if (option == "--warmup") {
+                spec.warmup = value == "0" ? 0 : detail::parsePositive(value);
+            } else if (option == "--reps") {
+                spec.repetitions = detail::parsePositive(value);
+            } else if (option == "--seed") {
+                spec.seed = detail::parseSeed(value);
+            } else if (option == "--format" && (value == "csv" || value == "json")) {
+                format = value;
+            } else {
+                throw std::invalid_argument("unknown option " + option + " " + value);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "econBench: " << e.what() << std::endl;
+        std::cerr << "usage: econBench [--modes dma,mpi] [--traders N,...] [--threads N,...] [--rounds N]"
+            << " [--warmup N] [--reps N] [--seed S] [--format csv|json]" << std::endl;
+        return 1;
+    }
+
+    std::vector<BenchResult> results = runBench(spec);
+    if (format == "json") {
+        writeBenchJson(std::cout, results);
+    } else {
+        writeBenchCsv(std::cout, results);
+    }
+    return 0;
+}
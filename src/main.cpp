@@ -1,75 +1,28 @@
 #include <iostream>
 #include <vector>
-#include <random>
-
-#include "simulation.h"
-#include "economics.h"
-#include "econDMAAgents.h"
-#include "econMPIAgents.h"
-
-void MPIEcon(int totalRounds);
-void DMAEcon(int totalRounds);
-
-// Main function
-int main() {
-    int totalRounds = 200;
-    DMAEcon(totalRounds);
-    return 0;
-}
-
-void MPIEcon(int totalRounds){
-    MPIMarket* market = new MPIMarket(0);
-    int traderIdOffset = 1;
-
-    // std::vector<int> simTraders = {999, 9999, 99999};
-    std::vector<int> simTraders = {9999};
-    
-    std::vector<MPITrader*> traderAgents = {};
-    for (const auto & totalTraders: simTraders) {
-        
-        // Initialize trader and market agents
-        int i = 0;
-        while (i < totalTraders) {
-            traderAgents.push_back(new MPITrader(i+traderIdOffset));    
-            i++;
-        }
-        for (const auto & trader: traderAgents) {
-            trader->updateMarket(market);
-        }
-        market->updateTraders(traderAgents);
-        std::vector<Agent*> agents = {};
-        agents.push_back(market);
-        agents.insert(agents.end(), traderAgents.begin(), traderAgents.end());
-        Simulate simulation(agents, totalRounds);
-        simulation.run();
+#include <thread>
+#include <algorithm>
+
+#include "experiment.h"
+
+// Run a parameter sweep, by default the DMA economy with 999, 9999 and 99999
+// traders for 200 rounds, and print one table with a row per run
+int main(int argc, char** argv) {
+    int jobs = 0;
+    SweepSpec spec;
+    try {
+        spec = parseSweepArgs(argc, argv, jobs);
+    } catch (const std::exception& e) {
+        std::cerr << "econSim: " << e.what() << std::endl;
+        std::cerr << "usage: econSim [--traders N,...] [--rounds N,...] [--modes dma,mpi] [--seeds S,...]"
+            << " [--replicas N] [--threads N] [--jobs N]" << std::endl;
+        return 1;
     }
-}
-
-void DMAEcon(int totalRounds){
-    DMAMarket* market = new DMAMarket(0);
-    int traderIdOffset = 1;
-
-    std::vector<int> simTraders = {999, 9999, 99999};
-    // std::vector<int> simTraders = {99999};
-    
-    std::vector<DMATrader*> traderAgents = {};
-    for (const auto & totalTraders: simTraders) {
-        
-        // Initialize trader and market agents
-        int i = 0;
-        while (i < totalTraders) {
-            traderAgents.push_back(new DMATrader(i+traderIdOffset));    
-            i++;
-        }
-        for (const auto & trader: traderAgents) {
-            trader->updateMarket(market);
-        }
-        market->updateTraders(traderAgents);
-        std::vector<Agent*> agents = {};
-        agents.push_back(market);
-        agents.insert(agents.end(), traderAgents.begin(), traderAgents.end());
-        Simulate simulation1(agents, totalRounds);
-        simulation1.run();
+    if (jobs == 0) {
+        // one configuration per core, each stepping with threadsPerRun threads
+        int cores = std::max(1u, std::thread::hardware_concurrency());
+        jobs = std::max(1, cores / spec.threadsPerRun);
     }
+    printResults(std::cout, runSweep(spec, jobs));
+    return 0;
 }
-
@@ -1,6 +1,11 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 #include "simulation.h"
+#include "economics.h"
+#include "traderPopulation.h"
+#include "econDMAAgents.h"
+#include "experiment.h"
+#include "benchmark.h"
 
 TEST_CASE("MessageTests - content") {
     std::vector<double> msg1 = {1, 2, 3, 4};
@@ -26,7 +31,7 @@ TEST_CASE("AgentTests - addToMailbox/receive") {
     int totalMessages = 0;
     std::optional<Message> m = A1.receive();
     while (m.has_value()) {
-        const std::vector<double>* retrievedContent = m.value().getContent();
+        const Payload* retrievedContent = m.value().getContent();
         CHECK(*retrievedContent == msg1);
         m = A1.receive();
         totalMessages +=1 ;
@@ -43,18 +48,15 @@ TEST_CASE("AgentTests - send/collect") {
         A1.send(i, m1);
     }
 
-    std::unordered_map<int, std::deque<Message>> collectedMessages = A1.outbox;
+    std::vector<std::pair<int, Message>> collectedMessages = A1.outbox;
     std::set<int> expectedRids = {0,1,2,3,4};
 
     int totalMessages = 0;
     for (const auto& pair : collectedMessages) {
         int key = pair.first;
         CHECK(expectedRids.count(key) == 1);
-        const std::deque<Message>& messages = pair.second;
-        for (const auto& message : messages) {
-            CHECK(*message.getContent() == msg1);
-            totalMessages += 1;
-        }
+        CHECK(*pair.second.getContent() == msg1);
+        totalMessages += 1;
     }
 
     CHECK(totalMessages == expectedTotalMessages);
@@ -72,6 +74,15 @@ TEST_CASE("SimulateTests - init") {
     CHECK(sim1.hasAgent(2) == false);
 }
 
+TEST_CASE("SimulateTests - empty simulation runs to completion") {
+    Simulate sim({}, 3, 2);
+    sim.setVerbose(false);
+    RunStats stats = sim.run();
+    CHECK(stats.agents == 0);
+    CHECK(stats.agentsStepped() == 0);
+    CHECK(stats.messages() == 0);
+}
+
 TEST_CASE("SimulateTests - deliver messages") {
     std::vector<Agent*> agents2;
     Agent* A1 = new Agent(1);
@@ -100,4 +111,1140 @@ TEST_CASE("SimulateTests - deliver messages") {
         totalMessages +=1 ;
     }
     CHECK(totalMessages == expectedTotalMessages);
-}
\ No newline at end of file
+}
+// Sends its running total to the next agent and adds up whatever it receives
+class RelayAgent: public Agent {
+public:
+    int total;
+    int next;
+
+    RelayAgent(int id, int next) : Agent(id) {
+        this->total = id;
+        this->next = next;
+    }
+
+    virtual int step() {
+        std::optional<Message> m = receive();
+        while (m.has_value()) {
+            // order-sensitive fold, kept small so it cannot overflow
+            this->total = (this->total * 3 + static_cast<int>((*m.value().getContent())[0]) % 1000) % 1000003;
+            m = receive();
+        }
+        send(this->next, Message({static_cast<double>(this->total % 1000)}));
+        return 1;
+    }
+};
+
+std::vector<int> runRelay(int totalAgents, int threads) {
+    std::vector<RelayAgent*> relays;
+    std::vector<Agent*> agents;
+    for (int i = 0; i < totalAgents; i++) {
+        relays.push_back(new RelayAgent(i, (i * 7 + 1) % totalAgents));
+        agents.push_back(relays.back());
+    }
+    Simulate sim(agents, 20, threads);
+    sim.run();
+    std::vector<int> totals;
+    for (auto relay : relays) {
+        totals.push_back(relay->total);
+        delete relay;
+    }
+    return totals;
+}
+
+TEST_CASE("SimulateTests - parallel run matches serial run") {
+    std::vector<int> serial = runRelay(101, 1);
+    CHECK(runRelay(101, 2) == serial);
+    CHECK(runRelay(101, 4) == serial);
+}
+
+TEST_CASE("WorkerPoolTests - exceptions reach the caller after every worker is done") {
+    WorkerPool pool(3);
+    std::vector<int> finished(3, 0);
+    auto failOn = [&](int failing) {
+        return [&, failing](int worker) {
+            if (worker == failing) {
+                throw std::runtime_error("worker failed");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            finished[worker] += 1;
+        };
+    };
+    CHECK_THROWS_AS(pool.run(failOn(0)), std::runtime_error);
+    CHECK(finished == std::vector<int>{0, 1, 1});
+    CHECK_THROWS_AS(pool.run(failOn(2)), std::runtime_error);
+    CHECK(finished == std::vector<int>{1, 2, 1});
+    // the pool stays usable
+    pool.run(failOn(-1));
+    CHECK(finished == std::vector<int>{2, 3, 2});
+}
+
+class CountingSender: public Agent {
+public:
+    int rounds = 0;
+    CountingSender(int id) : Agent(id) {}
+
+    virtual int step() {
+        send(this->id + 1, Message({static_cast<double>(this->rounds)}));
+        this->rounds += 1;
+        return 1;
+    }
+};
+
+class RecordingReceiver: public Agent {
+public:
+    std::vector<double> received;
+    RecordingReceiver(int id) : Agent(id) {}
+
+    virtual int step() {
+        std::optional<Message> m = receive();
+        while (m.has_value()) {
+            this->received.push_back((*m.value().getContent())[0]);
+            m = receive();
+        }
+        return 1;
+    }
+};
+
+TEST_CASE("SimulateTests - messages sent in round N are read in round N+1") {
+    CountingSender sender(0);
+    RecordingReceiver receiver(1);
+    std::vector<Agent*> agents = {&receiver, &sender};
+
+    Simulate sim(agents, 3, 2);
+    sim.run();
+    std::vector<double> expected = {0, 1};
+    CHECK(receiver.received == expected);
+}
+
+TEST_CASE("AgentTableTests - contiguous, gapped and sparse ids") {
+    Agent A1(5), A2(6), A3(7), A4(100), A5(1000000), A6(9);
+
+    std::unordered_map<int, Agent*> dense = {{5, &A1}, {6, &A2}, {7, &A3}};
+    AgentTable denseTable;
+    denseTable.build(dense);
+    CHECK(denseTable.size() == 3);
+    CHECK(denseTable.slotOf(5) == 0);
+    CHECK(denseTable.slotOf(7) == 2);
+    CHECK(denseTable.slotOf(8) == AgentTable::NO_SLOT);
+    CHECK(denseTable.at(1) == &A2);
+
+    // gaps within 4x the agent count use the id -> slot array
+    std::unordered_map<int, Agent*> gapped = {{5, &A1}, {7, &A3}, {9, &A6}};
+    AgentTable gappedTable;
+    gappedTable.build(gapped);
+    CHECK(gappedTable.slotOf(5) == 0);
+    CHECK(gappedTable.slotOf(7) == 1);
+    CHECK(gappedTable.slotOf(9) == 2);
+    CHECK(gappedTable.slotOf(6) == AgentTable::NO_SLOT);
+    CHECK(gappedTable.slotOf(8) == AgentTable::NO_SLOT);
+    CHECK(gappedTable.slotOf(4) == AgentTable::NO_SLOT);
+    CHECK(gappedTable.slotOf(10) == AgentTable::NO_SLOT);
+    CHECK(gappedTable.at(2) == &A6);
+
+    std::unordered_map<int, Agent*> sparse = {{5, &A1}, {100, &A4}, {1000000, &A5}};
+    AgentTable sparseTable;
+    sparseTable.build(sparse);
+    CHECK(sparseTable.slotOf(5) == 0);
+    CHECK(sparseTable.slotOf(100) == 1);
+    CHECK(sparseTable.slotOf(1000000) == 2);
+    CHECK(sparseTable.slotOf(6) == AgentTable::NO_SLOT);
+    CHECK(sparseTable.at(2) == &A5);
+}
+
+// Wakes up every `period` rounds and records the rounds it ran in
+class PeriodicAgent: public Agent {
+public:
+    int period;
+    int round = 0;
+    std::vector<int> steppedRounds;
+    PeriodicAgent(int id, int period) : Agent(id) {
+        this->period = period;
+    }
+
+    virtual int step() {
+        this->steppedRounds.push_back(this->round);
+        this->round += this->period;
+        return this->period;
+    }
+};
+
+TEST_CASE("SimulateTests - event-driven scheduler steps only due agents") {
+    PeriodicAgent slow(0, 5);
+    PeriodicAgent fast(1, 2);
+    std::vector<Agent*> agents = {&slow, &fast};
+
+    Simulate sim(agents, 10);
+    sim.setScheduler(Scheduler::EventDriven);
+    sim.run();
+
+    std::vector<int> slowRounds = {0, 5};
+    std::vector<int> fastRounds = {0, 2, 4, 6, 8};
+    CHECK(slow.steppedRounds == slowRounds);
+    CHECK(fast.steppedRounds == fastRounds);
+}
+
+// Only ever runs again when woken up by mail
+class SleepingReceiver: public RecordingReceiver {
+public:
+    SleepingReceiver(int id) : RecordingReceiver(id) {}
+
+    virtual int step() {
+        RecordingReceiver::step();
+        return 100;
+    }
+};
+
+TEST_CASE("SimulateTests - event-driven scheduler wakes agents with new mail") {
+    CountingSender sender(0);
+    SleepingReceiver receiver(1);
+    PeriodicAgent idle(2, 100);
+    std::vector<Agent*> agents = {&sender, &receiver, &idle};
+
+    Simulate sim(agents, 4);
+    sim.setScheduler(Scheduler::EventDriven);
+    sim.run();
+
+    std::vector<double> expected = {0, 1, 2};
+    CHECK(receiver.received == expected);
+    CHECK(idle.steppedRounds.size() == 1);
+}
+
+// Never asks to run again, only mail wakes it up
+class DormantReceiver: public RecordingReceiver {
+public:
+    int steps = 0;
+    DormantReceiver(int id) : RecordingReceiver(id) {}
+
+    virtual int step() {
+        RecordingReceiver::step();
+        this->steps += 1;
+        return INT_MAX;
+    }
+};
+
+// Sends its step count to agent 1 every `period` rounds
+class PeriodicSender: public PeriodicAgent {
+public:
+    PeriodicSender(int id, int period) : PeriodicAgent(id, period) {}
+
+    virtual int step() {
+        send(1, Message({static_cast<double>(this->steppedRounds.size())}));
+        return PeriodicAgent::step();
+    }
+};
+
+TEST_CASE("SimulateTests - agents that never ask to run again sleep until mail arrives") {
+    PeriodicSender sender(0, 4);
+    DormantReceiver receiver(1);
+    std::vector<Agent*> agents = {&sender, &receiver};
+
+    Simulate sim(agents, 10);
+    sim.setVerbose(false);
+    sim.setScheduler(Scheduler::EventDriven);
+    sim.run();
+
+    // stepped in round 0 and the round after each send in rounds 0, 4 and 8
+    CHECK(receiver.steps == 4);
+    std::vector<double> expected = {0, 1, 2};
+    CHECK(receiver.received == expected);
+
+    DormantReceiver alone(1);
+    std::vector<Agent*> lone = {&alone};
+    Simulate allAgents(lone, 10);
+    allAgents.setVerbose(false);
+    RunStats stats = allAgents.run();
+    CHECK(stats.rounds.size() == 1);
+}
+
+TEST_CASE("MessageCSRTests - counting sort by recipient keeps sender order") {
+    MessageCSR csr;
+    csr.reset(4);
+    std::vector<std::vector<std::pair<int, Message>>> shards(2);
+    shards[0].emplace_back(2, Message({1}));
+    shards[0].emplace_back(0, Message({2}));
+    shards[1].emplace_back(2, Message({3}));
+    shards[1].emplace_back(3, Message({4}));
+    std::vector<int> mailSlots;
+    csr.build(shards, mailSlots);
+
+    std::vector<int> expectedSlots = {0, 2, 3};
+    CHECK(mailSlots == expectedSlots);
+    CHECK(csr.count(0) == 1);
+    CHECK(csr.count(1) == 0);
+    CHECK(csr.count(2) == 2);
+    CHECK((*csr.inbox(2)[0].getContent())[0] == 1);
+    CHECK((*csr.inbox(2)[1].getContent())[0] == 3);
+    CHECK((*csr.inbox(3)[0].getContent())[0] == 4);
+    CHECK(shards[0].empty());
+    CHECK(shards[1].empty());
+}
+
+TEST_CASE("AgentTests - broadcast shares one payload between subscribers") {
+    Agent sender(0);
+    std::vector<RecordingReceiver*> receivers;
+    std::vector<Agent*> agents = {&sender};
+    for (int i = 1; i <= 3; i++) {
+        receivers.push_back(new RecordingReceiver(i));
+        agents.push_back(receivers.back());
+    }
+    receivers[0]->subscribe(0);
+    receivers[2]->subscribe(0);
+
+    sender.broadcast(0, Message({7}));
+    CHECK(sender.broadcasts.size() == 1);
+    CHECK(sender.broadcasts[0].second.isShared());
+
+    Message copy = sender.broadcasts[0].second;
+    CHECK(copy.getContent() == sender.broadcasts[0].second.getContent());
+
+    Simulate sim(agents, 2);
+    sim.run();
+    std::vector<double> expected = {7};
+    CHECK(receivers[0]->received == expected);
+    CHECK(receivers[1]->received.empty());
+    CHECK(receivers[2]->received == expected);
+    for (auto receiver : receivers) {
+        delete receiver;
+    }
+}
+
+TEST_CASE("MessageTests - small payloads are stored inline") {
+    Message small({1, 2, 3, 4, 5});
+    CHECK(small.getContent()->isInline());
+    CHECK(small.getContent()->size() == 5);
+    CHECK((*small.getContent())[4] == 5);
+
+    std::vector<double> values = {1, 2, 3, 4, 5, 6, 7, 8};
+    Message large(values);
+    CHECK(!large.getContent()->isInline());
+    CHECK(*large.getContent() == values);
+
+    Message copied = large;
+    CHECK(*copied.getContent() == values);
+    CHECK(copied.getContent()->data() != large.getContent()->data());
+
+    const double* heapBlock = large.getContent()->data();
+    Message moved = std::move(large);
+    CHECK(moved.getContent()->data() == heapBlock);
+    CHECK(*moved.getContent() == values);
+}
+
+struct Ping {
+    int from;
+    double value;
+};
+
+// Sends a typed Ping to the next agent and sums the Pings it receives
+class TypedRelay: public Agent {
+public:
+    int next;
+    double total = 0;
+    int received = 0;
+    TypedRelay(int id, int next) : Agent(id) {
+        this->next = next;
+    }
+
+    virtual int step() {
+        this->received += receiveTyped<Ping>([&](const Ping& ping) {
+            this->total += ping.value * ping.from;
+        });
+        sendTyped(this->next, Ping{this->id, 0.5});
+        return 1;
+    }
+};
+
+TEST_CASE("AgentTests - typed messages") {
+    TypedRelay a(1, 2);
+    TypedRelay b(2, 1);
+    std::vector<Agent*> agents = {&a, &b};
+
+    Simulate sim(agents, 3, 2);
+    sim.run();
+    CHECK(a.received == 2);
+    CHECK(b.received == 2);
+    CHECK(a.total == 2 * 0.5 * 2);
+    CHECK(b.total == 2 * 0.5 * 1);
+
+    CHECK_THROWS_AS(a.sendTyped(2, Ping{1, 1.0}), std::logic_error);
+}
+
+struct Tally {
+    int count;
+    int sum;
+};
+
+class TallySender: public Agent {
+public:
+    TallySender(int id) : Agent(id) {}
+
+    virtual int step() {
+        sendTyped(0, Tally{1, this->id});
+        return 1;
+    }
+};
+
+class TallyCollector: public Agent {
+public:
+    std::vector<int> messagesPerRound;
+    std::vector<int> sums;
+    TallyCollector(int id) : Agent(id) {
+        combineTyped<Tally>([](Tally& total, const Tally& tally) {
+            total.count += tally.count;
+            total.sum += tally.sum;
+        });
+    }
+
+    virtual int step() {
+        int count = 0;
+        size_t received = receiveTyped<Tally>([&](const Tally& tally) {
+            count += tally.count;
+            this->sums.push_back(tally.sum);
+        });
+        this->messagesPerRound.push_back(static_cast<int>(received));
+        CHECK((received == 0 || count == 100));
+        return 1;
+    }
+};
+
+TEST_CASE("SimulateTests - combiners fold many-to-one messages") {
+    TallyCollector collector(0);
+    std::vector<TallySender*> senders;
+    std::vector<Agent*> agents = {&collector};
+    for (int i = 1; i <= 100; i++) {
+        senders.push_back(new TallySender(i));
+        agents.push_back(senders.back());
+    }
+
+    Simulate sim(agents, 3, 3);
+    sim.run();
+    std::vector<int> expectedMessages = {0, 1, 1};
+    std::vector<int> expectedSums = {5050, 5050};
+    CHECK(collector.messagesPerRound == expectedMessages);
+    CHECK(collector.sums == expectedSums);
+    for (auto sender : senders) {
+        delete sender;
+    }
+}
+
+TEST_CASE("StockTests - rolling averages match a full recomputation") {
+    RollingWindow window(10);
+    std::vector<double> history;
+    for (int i = 0; i < 1000; i++) {
+        double price = 100 + (i * 37 % 101) * 0.37;
+        window.push(price);
+        history.push_back(price);
+        size_t n = std::min<size_t>(history.size(), 10);
+        double expected = std::accumulate(history.end() - n, history.end(), 0.0) / n;
+        CHECK(window.mean() == doctest::Approx(expected));
+        CHECK(window.full() == (history.size() >= 10));
+    }
+
+    Stock stock(0.01);
+    std::vector<int> states;
+    for (int i = 0; i < 60; i++) {
+        states = stock.getStockStates(100 + i, 0);
+    }
+    std::vector<int> rising = {NO_CHANGE, INCREASE, INCREASE};
+    CHECK(states == rising);
+}
+
+TEST_CASE("StockTests - indicators match a full recomputation") {
+    IndicatorSet indicators({{IndicatorKind::SMA, 5}, {IndicatorKind::EMA, 4}, {IndicatorKind::Volatility, 6},
+        {IndicatorKind::Momentum, 3}, {IndicatorKind::Min, 7}, {IndicatorKind::Max, 7}});
+    CHECK(indicators.size() == 6);
+
+    std::vector<double> prices;
+    double ema = 0;
+    bool matches = true;
+    for (int i = 0; i < 300; i++) {
+        double price = 100 + (i * 53 % 97) * 0.25 - (i % 5);
+        prices.push_back(price);
+        indicators.update(price);
+        ema = i == 0 ? price : ema + 0.4 * (price - ema);
+        size_t n = prices.size();
+        if (n < 8) {
+            continue;
+        }
+        double sma = std::accumulate(prices.end() - 5, prices.end(), 0.0) / 5;
+        double mean6 = std::accumulate(prices.end() - 6, prices.end(), 0.0) / 6;
+        double variance = 0;
+        for (auto it = prices.end() - 6; it != prices.end(); it++) {
+            variance += (*it - mean6) * (*it - mean6) / 6;
+        }
+        matches = matches && indicators.value(0) == doctest::Approx(sma);
+        matches = matches && indicators.value(1) == doctest::Approx(ema);
+        matches = matches && indicators.value(2) == doctest::Approx(std::sqrt(variance));
+        matches = matches && indicators.value(3) == doctest::Approx(price - prices[n - 4]);
+        matches = matches && indicators.value(4) == *std::min_element(prices.end() - 7, prices.end());
+        matches = matches && indicators.value(5) == *std::max_element(prices.end() - 7, prices.end());
+    }
+    CHECK(matches);
+
+    IndicatorSet rising({{IndicatorKind::SMA, 2}, {IndicatorKind::Min, 2}});
+    rising.update(1);
+    CHECK(rising.getBits() == 0);
+    rising.update(2);
+    rising.update(3);
+    CHECK(IndicatorSet::state(rising.getBits(), 0) == INCREASE);
+    CHECK(IndicatorSet::state(rising.getBits(), 1) == INCREASE);
+    rising.update(0);
+    CHECK(IndicatorSet::state(rising.getBits(), 0) == DECREASE);
+    CHECK(IndicatorSet::state(rising.getBits(), 1) == DECREASE);
+}
+
+TEST_CASE("StockTests - markets report the indicators configured on their stock") {
+    std::vector<IndicatorSpec> specs = {{IndicatorKind::EMA, 3}, {IndicatorKind::Momentum, 2}, {IndicatorKind::Max, 5}};
+    Stock stock(0.01);
+    CHECK_THROWS_AS(stock.configureIndicators({{IndicatorKind::SMA, 5}}), std::invalid_argument);
+    CHECK(stock.getStockStates(100, 0).size() == 3);
+    stock.configureIndicators(specs);
+    CHECK(stock.getStockStates(101, 0).size() == 4);
+
+    setMasterSeed(7);
+    Simulate sim({}, 1);
+    sim.setVerbose(false);
+    MPIMarket& market = sim.emplaceAgents<MPIMarket>(1, 0)[0];
+    market.getStock().configureIndicators(specs);
+    std::vector<MPITrader*> traders;
+    for (auto & trader : sim.emplaceAgents<MPITrader>(30, 1)) {
+        trader.updateMarket(&market);
+        traders.push_back(&trader);
+    }
+    market.updateTraders(traders);
+    // the market feeds every round's price to its indicators
+    IndicatorSet reference(specs);
+    bool matches = true;
+    for (int round = 0; round < 20; round++) {
+        sim.maxRounds = round + 1;
+        sim.run();
+        reference.update(market.getStockPrice());
+        matches = matches && market.getStock().getIndicatorBits() == reference.getBits();
+    }
+    CHECK(matches);
+    // the third indicator is reported as well
+    CHECK(IndicatorSet::state(reference.getBits(), 2) != NO_CHANGE);
+}
+
+TEST_CASE("StockTests - a market streams every price to its history file") {
+    const std::string path = "price_history_test.txt";
+    std::vector<double> prices;
+    {
+        setMasterSeed(5);
+        Simulate sim({}, 1);
+        sim.setVerbose(false);
+        MPIMarket& market = sim.emplaceAgents<MPIMarket>(1, 0)[0];
+        market.getStock().streamPriceHistory(path);
+        // adding traders keeps the market's stock and its settings
+        for (int block = 0; block < 2; block++) {
+            std::vector<MPITrader*> traders;
+            for (auto & trader : sim.emplaceAgents<MPITrader>(20, 1 + 20 * block)) {
+                trader.updateMarket(&market);
+                traders.push_back(&trader);
+            }
+            market.updateTraders(traders);
+        }
+        for (int round = 0; round < 25; round++) {
+            sim.maxRounds = round + 1;
+            sim.run();
+            prices.push_back(market.getStockPrice());
+        }
+    }
+
+    std::ifstream history(path);
+    std::vector<double> streamed;
+    double price;
+    while (history >> price) {
+        streamed.push_back(price);
+    }
+    CHECK(streamed == prices);
+    CHECK(std::any_of(prices.begin(), prices.end(), [](double p) { return p != 100; }));
+    std::remove(path.c_str());
+}
+
+TEST_CASE("TraderPopulationTests - batched kernel matches per-trader inform") {
+    TraderPopulation batched;
+    for (int i = 0; i < 103; i++) {
+        batched.add(i, 1000);
+    }
+    TraderPopulation reference = batched;
+
+    double price = 100;
+    for (int round = 0; round < 200; round++) {
+        std::vector<int> market = {round % 3, (round / 3) % 3, (round / 7) % 3};
+        double dividend = (round % 4) * 0.05;
+        batched.informAll(price, dividend, market);
+        int buys = 0;
+        for (size_t i = 0; i < reference.size(); i++) {
+            reference.inform(i, price, dividend, market);
+            buys += reference.action[i] == 1;
+        }
+        price = price * (1 + 0.001 * (buys - 50));
+    }
+    CHECK(batched.action == reference.action);
+    CHECK(batched.currentRule == reference.currentRule);
+    CHECK(batched.cash == reference.cash);
+    CHECK(batched.shares == reference.shares);
+    CHECK(batched.strengths == reference.strengths);
+}
+
+TEST_CASE("AgentRngTests - per-agent streams are small and reproducible") {
+    CHECK(sizeof(AgentRng) == 32);
+
+    setMasterSeed(42);
+    AgentRng a = AgentRng::forAgent(7);
+    AgentRng b = AgentRng::forAgent(7);
+    AgentRng c = AgentRng::forAgent(8);
+    CHECK(a == b);
+    CHECK(a() == b());
+    CHECK(a() != c());
+
+    setMasterSeed(43);
+    AgentRng d = AgentRng::forAgent(7);
+    CHECK(!(d == AgentRng::forAgent(8)));
+    AgentRng again = AgentRng::stream(42, RNG_AGENT_STREAM, 7);
+    again();
+    again();
+    CHECK(a == again);
+
+    std::uniform_int_distribution<int> distribution(1, 5);
+    bool inRange = true;
+    for (int i = 0; i < 1000; i++) {
+        int draw = distribution(d);
+        inRange = inRange && draw >= 1 && draw <= 5;
+    }
+    CHECK(inRange);
+
+    // splitting depends only on the parent's state and leaves it unchanged
+    AgentRng parent = AgentRng::stream(9, RNG_AGENT_STREAM, 3);
+    AgentRng parentCopy = parent;
+    AgentRng child = parent.split(1);
+    CHECK(parent == parentCopy);
+    CHECK(child == parentCopy.split(1));
+    CHECK(!(child == parent));
+    CHECK(!(child == parent.split(2)));
+    CHECK(child() != parent.split(2)());
+    parent();
+    CHECK(!(parent.split(1) == parentCopy.split(1)));
+
+    setMasterSeed(42);
+    TraderPopulation first;
+    TraderPopulation second;
+    for (int i = 0; i < 50; i++) {
+        first.add(i, 1000);
+        second.add(i, 1000);
+    }
+    std::vector<int> market = {INCREASE, DECREASE, INCREASE};
+    for (int round = 0; round < 20; round++) {
+        first.informAll(100, 0.01, market);
+        second.informAll(100, 0.01, market);
+    }
+    CHECK(first.currentRule == second.currentRule);
+    CHECK(first.cash == second.cash);
+}
+
+TEST_CASE("RuleStrengthsTests - incremental selection matches an ordered scan") {
+    RuleStrengths<> table;
+    std::array<int, TRADER_RULES> reference = {};
+    AgentRng rng(5);
+    std::uniform_int_distribution<int> distribution(1, TRADER_RULES);
+    bool matches = true;
+    for (int i = 0; i < 2000; i++) {
+        int rewarded = distribution(rng);
+        table.reward(rewarded);
+        reference[rewarded - 1] += 1;
+        for (int current = 1; current <= TRADER_RULES; current++) {
+            int scanned = current;
+            for (int rule = 1; rule <= TRADER_RULES; rule++) {
+                if (reference[rule - 1] > reference[scanned - 1]) {
+                    scanned = rule;
+                }
+            }
+            matches = matches && table.select(current) == scanned;
+        }
+    }
+    CHECK(matches);
+    CHECK(table.strength(1) == reference[0]);
+}
+
+TEST_CASE("SimulateTests - run reports per-round stats") {
+    CountingSender sender(0);
+    RecordingReceiver receiver(1);
+    TallySender tallies(2);
+    std::vector<Agent*> agents = {&sender, &receiver, &tallies};
+    Simulate sim(agents, 4, 2);
+    sim.setVerbose(false);
+    RunStats stats = sim.run();
+
+    REQUIRE(stats.rounds.size() == 4);
+    CHECK(stats.threads == 2);
+    CHECK(stats.agents == 3);
+    CHECK(stats.agentsStepped() == 12);
+    CHECK(stats.messages() == 8);
+    const RoundStats& round = stats.rounds[3];
+    CHECK(round.round == 3);
+    CHECK(round.volume.messages == 2);
+    CHECK(round.volume.broadcasts == 0);
+    CHECK(round.volume.bytes == sizeof(Message) + sizeof(Tally));
+    CHECK(round.totalNs >= round.deliverNs + round.stepNs + round.collectNs);
+    CHECK(stats.totalNs >= round.totalNs);
+    CHECK(stats.stepUtilization() > 0);
+    CHECK(stats.stepUtilization() <= 1);
+
+    std::ostringstream csv;
+    stats.writeCsv(csv);
+    std::string table = csv.str();
+    CHECK(std::count(table.begin(), table.end(), '\n') == 5);
+    CHECK(table.rfind("round,agents_stepped,", 0) == 0);
+    std::ostringstream json;
+    stats.writeJson(json);
+    CHECK(json.str().find("\"threads\":2") != std::string::npos);
+    CHECK(json.str().find("{\"round\":3,\"agents_stepped\":3,") != std::string::npos);
+}
+
+// Publishes the round number in phase 0; readers of phase 1 record it
+class PhaseWriter: public Agent {
+public:
+    int round = 0;
+    PhaseWriter(int id) : Agent(id) {}
+    virtual int step() {
+        this->round += 1;
+        this->send(0, Message{static_cast<double>(this->id)});
+        return 1;
+    }
+};
+
+class PhaseReader: public Agent {
+public:
+    const PhaseWriter* writer;
+    std::vector<int> seen;
+    PhaseReader(int id, const PhaseWriter* writer) : Agent(id), writer(writer) {
+        this->phase = 1;
+    }
+    virtual int step() {
+        this->seen.push_back(this->writer->round);
+        this->send(0, Message{static_cast<double>(this->id)});
+        return 1;
+    }
+};
+
+TEST_CASE("SimulateTests - phases step in order with a barrier between them") {
+    for (Scheduler mode : {Scheduler::AllAgents, Scheduler::EventDriven}) {
+        // the writer has the highest id, so id order alone would step it last
+        PhaseWriter writer(100);
+        std::vector<std::unique_ptr<PhaseReader>> readers;
+        RecordingReceiver sink(0);
+        std::vector<Agent*> agents = {&writer, &sink};
+        for (int i = 1; i <= 40; i++) {
+            readers.push_back(std::make_unique<PhaseReader>(i, &writer));
+            agents.push_back(readers.back().get());
+        }
+        Simulate sim(agents, 5, 4);
+        sim.setVerbose(false);
+        sim.setScheduler(mode);
+        sim.run();
+        std::vector<int> expected = {1, 2, 3, 4, 5};
+        bool ordered = true;
+        for (const auto & reader : readers) {
+            ordered = ordered && reader->seen == expected;
+        }
+        CHECK(ordered);
+        // inboxes list messages by sender phase and then sender id
+        std::vector<double> round = {100};
+        for (int i = 1; i <= 40; i++) {
+            round.push_back(i);
+        }
+        std::vector<double> delivered;
+        for (int i = 0; i < 4; i++) {
+            delivered.insert(delivered.end(), round.begin(), round.end());
+        }
+        CHECK(sink.received == delivered);
+    }
+}
+
+class PooledSender: public Agent {
+public:
+    int steps = 0;
+    PooledSender(int id) : Agent(id) {}
+    virtual int step() {
+        this->steps += 1;
+        this->send(0, Message{static_cast<double>(this->id)});
+        return 1;
+    }
+};
+
+TEST_CASE("SimulateTests - pooled agents step like virtual ones") {
+    AgentPool<PooledSender> senders(40);
+    for (int i = 1; i <= 41; i++) {
+        if (i != 21) {
+            senders.emplace(i);
+        }
+    }
+    CHECK_THROWS_AS(senders.emplace(42), std::length_error);
+    // an ad-hoc agent between the pool's ids takes the virtual path
+    PooledSender adHoc(21);
+    RecordingReceiver sink(0);
+    std::vector<Agent*> agents = {&sink, &adHoc};
+    Simulate sim(agents, 4, 3);
+    sim.addPool(senders);
+    CHECK(sim.hasAgent(41));
+    sim.run();
+
+    bool stepped = adHoc.steps == 4;
+    for (const auto & sender : senders) {
+        stepped = stepped && sender.steps == 4;
+    }
+    CHECK(stepped);
+    std::vector<double> delivered;
+    for (int round = 0; round < 3; round++) {
+        for (int i = 1; i <= 41; i++) {
+            delivered.push_back(i);
+        }
+    }
+    CHECK(sink.received == delivered);
+}
+
+class CountedAgent: public Agent {
+public:
+    static int alive;
+    int steps = 0;
+    double weight;
+    CountedAgent(int id, double weight) : Agent(id), weight(weight) {
+        alive += 1;
+    }
+    ~CountedAgent() {
+        alive -= 1;
+    }
+    virtual int step() {
+        this->steps += 1;
+        return 1;
+    }
+};
+
+int CountedAgent::alive = 0;
+
+TEST_CASE("SimulateTests - emplaced agents live in one block owned by the simulation") {
+    {
+        Simulate sim({}, 3);
+        AgentPool<CountedAgent>& agents = sim.emplaceAgents<CountedAgent>(100, 10, 0.5);
+        CHECK(CountedAgent::alive == 100);
+        CHECK(agents.size() == 100);
+        CHECK(&agents[99] == &agents[0] + 99);
+        CHECK(agents[0].id == 10);
+        CHECK(agents[99].id == 109);
+        CHECK(agents[99].weight == 0.5);
+        CHECK(sim.hasAgent(109));
+        sim.run();
+        CHECK(agents[50].steps == 3);
+    }
+    CHECK(CountedAgent::alive == 0);
+}
+
+// A DMA trader as a standalone object: its own wealth, rule strengths scanned
+// in rule order, and its agent stream
+struct ReferenceTrader {
+    WealthManagement wealth = WealthManagement(1000, 0.001);
+    std::array<int, TRADER_RULES> strengths = {};
+    int currentRule = 1;
+    int action = 0;
+    AgentRng gen;
+    std::uniform_int_distribution<int> distribution = std::uniform_int_distribution<int>(1, TRADER_RULES);
+
+    ReferenceTrader(int id) : gen(AgentRng::forAgent(id)) {}
+
+    void inform(double price, double dividend, const std::vector<int>& market) {
+        this->wealth.addDividends(dividend);
+        if (this->wealth.estimateWealth(price) > this->wealth.wealth) {
+            this->strengths[this->currentRule - 1] += 1;
+        }
+        if (this->distribution(this->gen) < 3) {
+            this->currentRule = this->distribution(this->gen);
+        } else {
+            for (int rule = 1; rule <= TRADER_RULES; rule++) {
+                if (this->strengths[rule - 1] > this->strengths[this->currentRule - 1]) {
+                    this->currentRule = rule;
+                }
+            }
+        }
+        int draw = this->currentRule == 4 ? this->distribution(this->gen) : 0;
+        this->action = TraderPopulation::eval(this->currentRule, price, market, this->wealth.cash, this->wealth.shares, draw);
+        if (this->action == BUY) {
+            this->wealth.buyStock(price);
+        } else if (this->action == SELL) {
+            this->wealth.sellStock(price);
+        }
+    }
+};
+
+TEST_CASE("DMATests - traders keep their state in the market's population") {
+    setMasterSeed(21);
+    DMAMarket market(0);
+    std::vector<std::unique_ptr<DMATrader>> traders;
+    std::vector<DMATrader*> handles;
+    std::vector<ReferenceTrader> references;
+    for (int i = 1; i <= 50; i++) {
+        traders.push_back(std::make_unique<DMATrader>(i));
+        traders.back()->updateMarket(&market);
+        handles.push_back(traders.back().get());
+        references.emplace_back(i);
+    }
+    // a growing trader list attaches every trader once
+    market.updateTraders(std::vector<DMATrader*>(handles.begin(), handles.begin() + 30));
+    market.updateTraders(handles);
+    TraderPopulation& population = market.getPopulation();
+    REQUIRE(population.size() == 50);
+    bool attached = true;
+    for (size_t i = 0; i < handles.size(); i++) {
+        attached = attached && handles[i]->isAttachedTo(&population) && population.ids[i] == handles[i]->id;
+    }
+    CHECK(attached);
+
+    // informing through the handles matches standalone traders
+    double price = 100;
+    bool matches = true;
+    for (int round = 0; round < 150; round++) {
+        std::vector<int> state = {round % 3, (round / 2) % 3, (round / 5) % 3};
+        double dividend = (round % 3) * 0.04;
+        int buys = 0;
+        for (size_t i = 0; i < handles.size(); i++) {
+            handles[i]->inform(price, dividend, state);
+            references[i].inform(price, dividend, state);
+            matches = matches && population.action[i] == references[i].action;
+            matches = matches && population.currentRule[i] == references[i].currentRule;
+            matches = matches && population.cash[i] == references[i].wealth.cash;
+            matches = matches && population.shares[i] == references[i].wealth.shares;
+            buys += references[i].action == BUY;
+        }
+        price = price * (1 + 0.002 * (buys - 10));
+    }
+    CHECK(matches);
+
+    // one round: the market informs every trader, each trader submits the
+    // action stored for it and the market tallies them
+    std::vector<Agent*> agents = {&market};
+    agents.insert(agents.end(), handles.begin(), handles.end());
+    Simulate sim(agents, 1);
+    sim.setVerbose(false);
+    sim.run();
+    CHECK(market.getBuyOrders() == std::count(population.action.begin(), population.action.end(), BUY));
+    CHECK(market.getSellOrders() == std::count(population.action.begin(), population.action.end(), SELL));
+    CHECK(market.getBuyOrders() + market.getSellOrders() > 0);
+}
+
+// Prices seen by a DMA market whose traders are informed and tallied by the
+// given number of market threads. Fused markets are simulated without their
+// traders.
+std::vector<double> runDMA(int marketThreads, std::vector<int>& orders, bool fused = false, int engineThreads = 1) {
+    setMasterSeed(11);
+    DMAMarket market(0);
+    market.setThreads(marketThreads);
+    market.setFusedRound(fused);
+    std::vector<std::unique_ptr<DMATrader>> traders;
+    std::vector<DMATrader*> handles;
+    std::vector<Agent*> agents = {&market};
+    for (int i = 1; i <= 301; i++) {
+        traders.push_back(std::make_unique<DMATrader>(i));
+        traders.back()->updateMarket(&market);
+        handles.push_back(traders.back().get());
+        if (!fused) {
+            agents.push_back(traders.back().get());
+        }
+    }
+    market.updateTraders(handles);
+    std::vector<double> prices;
+    for (int round = 0; round < 30; round++) {
+        Simulate sim(agents, 1, engineThreads);
+        sim.run();
+        prices.push_back(market.getStockPrice());
+    }
+    // every submitted order was tallied at the end of its round
+    const std::vector<int>& pending = market.getPopulation().orders;
+    CHECK(std::all_of(pending.begin(), pending.end(), [](int order) { return order == 0; }));
+    orders = market.getPopulation().action;
+    return prices;
+}
+
+TEST_CASE("DMATests - parallel inform and order tally match a single thread") {
+    std::vector<int> serialOrders;
+    std::vector<int> parallelOrders;
+    std::vector<double> serial = runDMA(1, serialOrders);
+    std::vector<double> parallel = runDMA(4, parallelOrders);
+    CHECK(serial == parallel);
+    CHECK(serialOrders == parallelOrders);
+    // the market phase informs every trader before any of them steps
+    std::vector<int> engineOrders;
+    CHECK(runDMA(2, engineOrders, false, 3) == serial);
+    CHECK(engineOrders == serialOrders);
+    CHECK(std::any_of(serial.begin(), serial.end(), [](double price) { return price != 100; }));
+}
+
+TEST_CASE("DMATests - fused round matches stepping every trader") {
+    std::vector<int> splitOrders;
+    std::vector<int> fusedOrders;
+    std::vector<double> split = runDMA(2, splitOrders);
+    std::vector<double> fused = runDMA(3, fusedOrders, true);
+    CHECK(split == fused);
+    CHECK(splitOrders == fusedOrders);
+}
+
+TEST_CASE("ExperimentTests - sweeps are reproducible whatever runs concurrently") {
+    SweepSpec spec;
+    spec.traderCounts = {20, 35};
+    spec.rounds = {12};
+    spec.modes = {EconMode::DMA, EconMode::MPI};
+    spec.seeds = {7};
+    spec.replicas = 2;
+    std::vector<ExperimentConfig> configs = expandSweep(spec);
+    REQUIRE(configs.size() == 8);
+    CHECK(configs[0].mode == EconMode::DMA);
+    CHECK(configs[1].replica == 1);
+    CHECK(configs[2].traders == 35);
+    CHECK(configs[4].mode == EconMode::MPI);
+
+    std::vector<ExperimentResult> serial = runSweep(spec, 1);
+    std::vector<ExperimentResult> concurrent = runSweep(spec, 3);
+    bool same = true;
+    for (size_t i = 0; i < configs.size(); i++) {
+        same = same && serial[i].config.traders == configs[i].traders && serial[i].finalPrice == concurrent[i].finalPrice
+            && serial[i].buyOrders == concurrent[i].buyOrders && serial[i].sellOrders == concurrent[i].sellOrders;
+    }
+    CHECK(same);
+    // each run has exactly its own traders, who order every round
+    CHECK(serial[2].buyOrders + serial[2].sellOrders <= 35 * 12);
+    CHECK(serial[0].buyOrders != serial[1].buyOrders);
+}
+
+TEST_CASE("ExperimentTests - sweep options") {
+    const char* args[] = {"econSim", "--traders", "10,20", "--modes", "mpi", "--seeds", "3,4", "--replicas", "2", "--jobs", "5"};
+    int jobs = 0;
+    SweepSpec spec = parseSweepArgs(11, const_cast<char**>(args), jobs);
+    CHECK(spec.traderCounts == std::vector<int>{10, 20});
+    CHECK(spec.modes == std::vector<EconMode>{EconMode::MPI});
+    CHECK(spec.seeds == std::vector<uint64_t>{3, 4});
+    CHECK(spec.rounds == std::vector<int>{200});
+    CHECK(spec.replicas == 2);
+    CHECK(jobs == 5);
+    const char* bad[] = {"econSim", "--modes", "dma,smp"};
+    CHECK_THROWS_AS(parseSweepArgs(3, const_cast<char**>(bad), jobs), std::invalid_argument);
+    CHECK(detail::parseSeed("18446744073709551615") == UINT64_MAX);
+    CHECK_THROWS_AS(detail::parseSeed("12abc"), std::invalid_argument);
+    CHECK_THROWS_AS(detail::parseSeed("-1"), std::invalid_argument);
+    CHECK_THROWS_AS(detail::parseSeed(""), std::invalid_argument);
+}
+
+TEST_CASE("BenchmarkTests - percentiles and a measured configuration") {
+    std::vector<int64_t> values = {5, 1, 4, 2, 3, 10, 9, 8, 7, 6};
+    CHECK(percentile(values, 0.5) == 5);
+    CHECK(percentile(values, 0.95) == 10);
+    CHECK(percentile(values, 0.1) == 1);
+    CHECK(percentile({}, 0.5) == 0);
+
+    BenchSpec spec;
+    spec.rounds = 5;
+    spec.warmup = 0;
+    spec.repetitions = 2;
+    BenchResult result = runBenchConfig(spec, EconMode::MPI, 30, 2);
+    CHECK(result.threads == 2);
+    CHECK(result.medianRoundNs > 0);
+    CHECK(result.p95RoundNs >= result.medianRoundNs);
+    CHECK(result.agentStepsPerSecond > 0);
+    CHECK(result.peakRssKb > 0);
+    std::ostringstream json;
+    writeBenchJson(json, {result});
+    CHECK(json.str().find("\"mode\":\"mpi\",\"traders\":30,\"threads\":2") != std::string::npos);
+}
+
+TEST_CASE("PerfCounterTests - counters are optional and never fail") {
+    PerfSample unavailable;
+    PerfSample counted = PerfSample::zero();
+    counted.counts = {100, 250, 3, -1};
+    PerfSample later = counted;
+    later.counts[PERF_CYCLES] = 160;
+    PerfSample delta = later - counted;
+    CHECK(delta.counts[PERF_CYCLES] == 60);
+    CHECK(delta.counts[PERF_INSTRUCTIONS] == 0);
+    CHECK(!delta.available(PERF_BRANCH_MISSES));
+    delta += unavailable;
+    CHECK(!delta.anyAvailable());
+
+    CountingSender sender(0);
+    RecordingReceiver receiver(1);
+    std::vector<Agent*> agents = {&sender, &receiver};
+    Simulate sim(agents, 3, 2);
+    sim.setVerbose(false);
+    sim.setPerfCounters(true);
+    RunStats stats = sim.run();
+    CHECK(stats.perfCounters);
+    // every event is either counted in every part or reported unavailable
+    PerfSample step = stats.totalPerf(&RoundStats::stepPerf);
+    bool consistent = true;
+    for (int event = 0; event < PERF_EVENTS; event++) {
+        consistent = consistent && step.counts[event] >= -1;
+        consistent = consistent && step.available(event) == threadPerfCounters().read().available(event);
+    }
+    CHECK(consistent);
+    std::ostringstream csv;
+    stats.writeCsv(csv);
+    CHECK(csv.str().find(",collect_branch_misses\n") != std::string::npos);
+
+    setMasterSeed(11);
+    DMAMarket market(0);
+    market.setThreads(2);
+    market.setPerfCounters(true);
+    AgentPool<DMATrader> traders(10);
+    std::vector<DMATrader*> handles;
+    for (int i = 1; i <= 10; i++) {
+        handles.push_back(traders.emplace(i));
+    }
+    market.updateTraders(handles);
+    market.step();
+    market.step();
+    CHECK(market.getStepPerf().size() == 2);
+    CHECK(market.getTotalStepPerf().anyAvailable() == threadPerfCounters().available());
+}
+
+TEST_CASE("TraceTests - engine spans export as Chrome trace events") {
+    PhaseWriter writer(100);
+    RecordingReceiver sink(0);
+    std::vector<Agent*> agents = {&writer, &sink};
+    Simulate sim(agents, 3, 2);
+    sim.setVerbose(false);
+    sim.emplaceAgents<PooledSender>(20, 1);
+    CHECK(sim.getTrace() == nullptr);
+    CHECK_THROWS_AS(sim.writeTrace(std::cout), std::logic_error);
+    sim.setTracing(1024);
+    sim.run();
+
+    const TraceRecorder* trace = sim.getTrace();
+    REQUIRE(trace != nullptr);
+    CHECK(trace->threads() == 2);
+    CHECK(trace->dropped() == 0);
+    // per round: deliver, step, collect and one phase; per worker: a slice
+    // and at least one batch
+    CHECK(trace->size() >= 3 * (4 + 2 * 2));
+    std::ostringstream json;
+    sim.writeTrace(json);
+    std::string events = json.str();
+    CHECK(events.rfind("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 0) == 0);
+    CHECK(events.find("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,") != std::string::npos);
+    CHECK(events.find("{\"name\":\"collect\",\"cat\":\"round\",\"ph\":\"X\",\"pid\":1,\"tid\":0,") != std::string::npos);
+    CHECK(events.find("{\"name\":\"worker\",\"cat\":\"worker\",\"ph\":\"X\",\"pid\":1,\"tid\":1,") != std::string::npos);
+    CHECK(events.find("{\"name\":\"PooledSender\",\"cat\":\"agents\",") != std::string::npos);
+    CHECK(events.find("\"args\":{\"round\":2,") != std::string::npos);
+
+    // full buffers drop events instead of growing
+    Simulate small(agents, 3, 1);
+    small.setVerbose(false);
+    small.setTracing(4);
+    small.run();
+    CHECK(small.getTrace()->size() == 4);
+    CHECK(small.getTrace()->dropped() > 0);
+
+    // names are written as given; only agent types are demangled
+    CHECK(std::string(traceTypeName<PooledSender>()) == "PooledSender");
+    TraceRecorder names(1, 2);
+    names.record(0, "i", "custom", 0, 1000, 0, 0);
+    std::ostringstream verbatim;
+    names.writeChromeJson(verbatim);
+    CHECK(verbatim.str().find("{\"name\":\"i\",\"cat\":\"custom\",") != std::string::npos);
+}